@@ -10,25 +10,137 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <pthread.h>
+#include <ctype.h>
+#include <stdarg.h>
+#include <sys/stat.h>
+#include <sys/select.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
-Register memory[SIZE_OF_MEM]; // 32 words of memory enough to store simple program
-Cache_Entry instructionCache[SIZE_OF_CACHE];
-Cache_Entry dataCache[SIZE_OF_CACHE];
+Register mainMemory[SIZE_OF_MEM]; // 32 words of memory enough to store simple program
+Core_s mainCores[MAX_NUM_CORES];
+unsigned char mainCodePages[NUM_CODE_PAGES];
+Register *memory = mainMemory; //The fuzzer points memory, cores and codePages at the machine it is running.
+Core_p cores = mainCores;
+unsigned char *codePages = mainCodePages; //Set once any word of the page has been fetched as an instruction.
+int numCores = 1;
+int executionMode = ROUND_ROBIN;
+int referenceOnly = 0; //RUN uses only completeOneInstructionCycle, no superblocks or fast-forwarding.
+Coherence_Stats coherenceStats;
+pthread_mutex_t busLock; //Recursive, so SWAP can hold the bus across its read and write.
+Symbol symbolTable[SYMBOL_TABLE_SIZE]; //Labels of the last assembled program.
+Symbol *symbolsByAddress[SYMBOL_TABLE_SIZE]; //The same labels hashed on their address, the first one defined at each.
+int numSymbols = 0;
+Monitor_s monitor;
+Trace_Settings trace = {TRACE_OFF, 0, NEG_NUM_MASK, ALL_OPCODES};
+Watchpoint watchpoints[MAX_NUM_WATCHPOINTS]; //Set by the debugger stub, checked on every data access.
+int numWatchpoints = 0;
+int watchHitType = 0; //Type of the watchpoint that fired since the debugger last cleared it, 0 if none.
+Register watchHitAddress;
+volatile int interruptRequested = 0; //Set by the debugger stub to stop a RUN in progress.
+int memoryLatency = MICROSECONDS_TO_SLEEP; //Sleep of every memory access, the fuzzer turns it off.
+Console_Script *consoleScript = NULL; //When set, the guest console is this script instead of the terminal.
 
-//Sets the condition codes, given a result.
-void setCC(short result, CPU_p cpu) {
+//Case-insensitive djb2 hash of a label.
+unsigned int hashSymbol(const char *name) {
+    unsigned int hash = 5381;
+    while (*name) {
+        hash = hash * 33 + tolower((unsigned char) *name++);
+    }
+    return hash & (SYMBOL_TABLE_SIZE - 1);
+}
+
+//Returns the table entry for name, or NULL if the label is not defined.
+Symbol *findSymbol(const char *name) {
+    unsigned int i = hashSymbol(name);
+    while (symbolTable[i].used) {
+        if (strcasecmp(symbolTable[i].name, name) == 0)
+            return &symbolTable[i];
+        i = (i + 1) & (SYMBOL_TABLE_SIZE - 1);
+    }
+    return NULL;
+}
+
+//Defines a label. Returns 0 on success, -1 if it is already defined, too long, or the table is full.
+int addSymbol(const char *name, Register address) {
+    unsigned int i = hashSymbol(name);
+    Symbol *symbol;
+    if (strlen(name) >= MAX_LABEL_LENGTH || numSymbols == SYMBOL_TABLE_SIZE - 1 || findSymbol(name) != NULL)
+        return -1;
+    while (symbolTable[i].used) {
+        i = (i + 1) & (SYMBOL_TABLE_SIZE - 1);
+    }
+    symbol = &symbolTable[i];
+    strcpy(symbol->name, name);
+    symbol->address = address;
+    symbol->used = 1;
+    numSymbols++;
+    for (i = address & (SYMBOL_TABLE_SIZE - 1); symbolsByAddress[i] != NULL; i = (i + 1) & (SYMBOL_TABLE_SIZE - 1)) {
+        if (symbolsByAddress[i]->address == address)
+            return 0;
+    }
+    symbolsByAddress[i] = symbol;
+    return 0;
+}
+
+//Returns the first label defined at an absolute address, or NULL.
+const char *symbolAt(Register address) {
+    unsigned int i;
+    for (i = address & (SYMBOL_TABLE_SIZE - 1); symbolsByAddress[i] != NULL; i = (i + 1) & (SYMBOL_TABLE_SIZE - 1)) {
+        if (symbolsByAddress[i]->address == address)
+            return symbolsByAddress[i]->name;
+    }
+    return NULL;
+}
+
+void clearSymbols() {
+    memset(symbolTable, 0, sizeof(symbolTable));
+    memset(symbolsByAddress, 0, sizeof(symbolsByAddress));
+    numSymbols = 0;
+}
+
+//Turns user input into an absolute address: a label of the loaded program, or a hex number.
+int resolveAddress(const char *input) {
+    char *end;
+    Symbol *symbol = findSymbol(input);
+    if (symbol != NULL)
+        return symbol->address;
+    return strtol(input, &end, STRTOL_BASE);
+}
+
+//Returns the condition code a result would set.
+Register conditionCode(short result) {
     if (result < 0) { //Negative result
-        cpu->CC = N;
+        return N;
     } else if (result == 0) { //Result = 0
-        cpu->CC = Z;
+        return Z;
     } else { //Positive result
-        cpu->CC = P;
+        return P;
     }
 }
 
+//Sets the condition codes, given a result.
+void setCC(short result, CPU_p cpu) {
+    cpu->CC = conditionCode(result);
+}
+
 //Prints out the register values, the IR, PC, MAR, and MDR.
-void printCurrentState(CPU_p cpu, ALU_p alu, int mem_Offset, unsigned short start_address);
+void printCurrentState(const char *title, CPU_p cpu, ALU_p alu, int mem_Offset, unsigned short start_address);
+void traceState(const char *title, CPU_p cpu, ALU_p alu);
+void traceAccess(CPU_p cpu, Register address, const char *kind, Register dataAddress, Register value);
 void getData(CPU_p cpu);
+void writeData(CPU_p cpu);
 
 //C equivalent of LC3's GETC
 char getch() {
@@ -57,60 +169,216 @@ char getch() {
 	return (buf);
 }
 
-//Function to handle TRAP routines.
-int trap(int trap_vector, CPU_p cpu) {
-    int index;
+//Reads a character for GETC, from the console script when there is one (0 once it runs out).
+char consoleGetChar() {
+    if (consoleScript == NULL)
+        return getch();
+    if (consoleScript->inputPosition < consoleScript->inputLength)
+        return consoleScript->input[consoleScript->inputPosition++];
+    return 0;
+}
+
+//Prints a character of guest output, or appends it to the console script's output.
+void consolePutChar(char c) {
+    if (consoleScript == NULL)
+        printf("%c", c);
+    else if (consoleScript->outputLength < BATCH_OUTPUT_SIZE - 1)
+        consoleScript->output[consoleScript->outputLength++] = c;
+}
+
+//Function to handle TRAP routines. With traced set, the memory the trap reads and writes is
+//traced for the TRAP at address like the data accesses of any other instruction.
+int trap(int trap_vector, CPU_p cpu, Register address, int traced) {
+    Register oldValue;
     switch(trap_vector) {
         case HALT:
             return HALT;
         case GETC:
-            cpu->regFile[0] = getch();
+            cpu->regFile[0] = consoleGetChar();
             break;
         case OUT:
-            printf("%c", cpu->regFile[0]);
+            monitor.onScreen = 0; //Guest output may scroll the monitor, redraw it whole next time.
+            consolePutChar(cpu->regFile[0]);
             fflush(stdout);
             break;
         case PUTS:
+            monitor.onScreen = 0;
             cpu->MAR = cpu->regFile[0];
             getData(cpu);
+            if (traced)
+                traceAccess(cpu, address, "read", cpu->MAR + cpu->origin, cpu->MDR);
             while (cpu->MDR != 0) {
-              printf("%c", cpu->MDR);
+              consolePutChar(cpu->MDR);
               cpu->MAR++;
               getData(cpu);
+              if (traced)
+                  traceAccess(cpu, address, "read", cpu->MAR + cpu->origin, cpu->MDR);
             }
             fflush(stdout);
             break;
+        case SWAP: //Holds the bus so no other core can touch M[R1] between the read and the write.
+            pthread_mutex_lock(&busLock);
+            cpu->MAR = cpu->regFile[1];
+            getData(cpu);
+            oldValue = cpu->MDR;
+            cpu->MDR = cpu->regFile[0];
+            writeData(cpu);
+            if (traced) {
+                traceAccess(cpu, address, "read", cpu->MAR + cpu->origin, oldValue);
+                traceAccess(cpu, address, "write", cpu->MAR + cpu->origin, cpu->MDR);
+            }
+            cpu->regFile[0] = oldValue;
+            coherenceStats.atomics++;
+            pthread_mutex_unlock(&busLock);
+            break;
+        case CPUID:
+            cpu->regFile[0] = cpu->coreId;
+            break;
     }
     return 0;
 }
 
 //Sets all the cache values to zero.
 void initializeCaches() {
-    int i, j;
-    for (i = 0; i < SIZE_OF_CACHE; i++) {
-          instructionCache[i].entryInfo = 0;
-          instructionCache[i].data = 0;
-          dataCache[i].entryInfo = 0;
-          dataCache[i].data = 0;
+    int i, c;
+    for (c = 0; c < MAX_NUM_CORES; c++) {
+        for (i = 0; i < SIZE_OF_CACHE; i++) {
+            cores[c].instructionCache[i].entryInfo = 0;
+            cores[c].instructionCache[i].data = 0;
+            cores[c].dataCache[i].entryInfo = 0;
+            cores[c].dataCache[i].data = 0;
+        }
+    }
+    memset(&coherenceStats, 0, sizeof(coherenceStats));
+    memset(codePages, 0, NUM_CODE_PAGES);
+}
+
+//Resets every core to the start of the program and wires it to its private caches.
+void initializeCores(Register origin) {
+    int c;
+    for (c = 0; c < MAX_NUM_CORES; c++) {
+        memset(&cores[c].cpu, 0, sizeof(CPU_s));
+        memset(&cores[c].alu, 0, sizeof(ALU_s));
+        cores[c].cpu.PC = 0;
+        cores[c].cpu.CC = Z;
+        cores[c].cpu.coreId = c;
+        cores[c].cpu.origin = origin;
+        cores[c].cpu.instructionCache = cores[c].instructionCache;
+        cores[c].cpu.dataCache = cores[c].dataCache;
+        cores[c].halted = 0;
+        cores[c].fallThroughPC = 0;
+        memset(cores[c].executionCount, 0, sizeof(cores[c].executionCount));
+        memset(cores[c].superblocks, 0, sizeof(cores[c].superblocks));
+    }
+}
+
+//Bus read: every other core holding memAddress flushes it if Modified and drops to Shared.
+//Returns 1 if some other core still holds a copy.
+int snoopBusRead(CPU_p cpu, Register memAddress) {
+    int c, shared = 0;
+    Register index = memAddress % SIZE_OF_CACHE;
+    Register tagFromAddress = memAddress / SIZE_OF_CACHE;
+    for (c = 0; c < numCores; c++) {
+        Cache_Entry *line = &cores[c].dataCache[index];
+        if (c == cpu->coreId || !(line->entryInfo & VALID_BIT_MASK) || (line->entryInfo & TAG_MASK) != tagFromAddress) {
+            continue;
+        }
+        if (line->entryInfo & DIRTY_BIT_MASK) { //Modified, supply the data through memory.
+            memory[memAddress] = line->data;
+            coherenceStats.interventions++;
+        }
+        line->entryInfo = (line->entryInfo & ~MESI_STATE_MASK) | SHARED_STATE;
+        shared = 1;
+    }
+    return shared;
+}
+
+//Bus read exclusive / upgrade: every other copy of memAddress is invalidated.
+void snoopBusInvalidate(CPU_p cpu, Register memAddress) {
+    int c;
+    Register index = memAddress % SIZE_OF_CACHE;
+    Register tagFromAddress = memAddress / SIZE_OF_CACHE;
+    for (c = 0; c < numCores; c++) {
+        Cache_Entry *line = &cores[c].dataCache[index];
+        if (c == cpu->coreId || !(line->entryInfo & VALID_BIT_MASK) || (line->entryInfo & TAG_MASK) != tagFromAddress) {
+            continue;
+        }
+        line->entryInfo = 0;
+        coherenceStats.invalidations++;
+    }
+}
+
+//Bus read for an instruction fetch. The instruction cache reads memory, so the fetching core's
+//own Modified copy of memAddress is written back as well, and stays as Exclusive.
+void snoopInstructionFetch(CPU_p cpu, Register memAddress) {
+    Cache_Entry *line = &cpu->dataCache[memAddress % SIZE_OF_CACHE];
+    snoopBusRead(cpu, memAddress);
+    if ((line->entryInfo & MESI_STATE_MASK) == MODIFIED_STATE && (line->entryInfo & TAG_MASK) == memAddress / SIZE_OF_CACHE) {
+        memory[memAddress] = line->data;
+        line->entryInfo = (line->entryInfo & ~MESI_STATE_MASK) | EXCLUSIVE_STATE;
+        coherenceStats.writeBacks++;
     }
 }
 
 //Accesses memory and updates the cache.
 void accessMemory(CPU_p cpu, Register cacheIndex, Cache_Entry cache[]) {
-    usleep(MICROSECONDS_TO_SLEEP); //Sleep to simulate memory accessing in the real world.
+    cpu->memoryStall += memoryLatency; //Simulates memory accessing in the real world, see memoryStall.
+    PERF_COUNT(cpu, cycles, MEMORY_ACCESS_CYCLES);
     cpu->MDR = memory[cpu->MAR]; //Load the data from memory.
     cache[cacheIndex].data = cpu->MDR; //Put the data into the dataCache.
 }
 
+//Sleeps off the memory latency a core ran up. Memory accesses happen with the bus lock held, so
+//they only add to cpu->memoryStall, and this is called once the lock is released: the core waits
+//on its own without keeping the other cores off the bus.
+void memoryStall(CPU_p cpu) {
+    if (cpu->memoryStall) {
+        usleep(cpu->memoryStall);
+        cpu->memoryStall = 0;
+    }
+}
+
+//Drops every core's instruction cache copy of memAddress after it was overwritten, so the next
+//fetch rereads memory. Anything that caches decoded instructions must be invalidated here too.
+void invalidateCode(Register memAddress) {
+    int c, i;
+    Register index = memAddress % SIZE_OF_CACHE;
+    Register tagFromAddress = memAddress / SIZE_OF_CACHE;
+    for (c = 0; c < numCores; c++) {
+        Cache_Entry *line = &cores[c].instructionCache[index];
+        if ((line->entryInfo & VALID_BIT_MASK) && (line->entryInfo & TAG_MASK) == tagFromAddress) {
+            line->entryInfo = 0;
+        }
+        for (i = 0; i < NUM_SUPERBLOCKS; i++) {
+            Superblock *sb = &cores[c].superblocks[i];
+            if (sb->valid && memAddress >= sb->lowAddress && memAddress <= sb->highAddress) {
+                sb->valid = 0;
+            }
+        }
+    }
+}
+
+//Returns 1 if memAddress lies in a page that has been executed. Stores to data-only pages
+//stop at this lookup.
+int isCodeAddress(Register memAddress) {
+    return memAddress < SIZE_OF_MEM && codePages[memAddress / CODE_PAGE_SIZE];
+}
+
 //Places the current instruction into the MDR. Checks the instruction cache, and accesses
 //memory if necessary.
 void getInstruction(CPU_p cpu) {
+    Cache_Entry *instructionCache = cpu->instructionCache;
     Register memAddress = cpu->MAR;
     int index = memAddress % SIZE_OF_CACHE;
     unsigned short tagFromAddress = memAddress / SIZE_OF_CACHE;
     
+    pthread_mutex_lock(&busLock);
+    if (memAddress < SIZE_OF_MEM)
+        codePages[memAddress / CODE_PAGE_SIZE] = 1;
     if (!(instructionCache[index].entryInfo & VALID_BIT_MASK)) { //validBit not set
         instructionCache[index].entryInfo = instructionCache[index].entryInfo | (VALID_BIT_MASK + tagFromAddress);
+        PERF_COUNT(cpu, instructionCacheMisses, 1);
+        snoopInstructionFetch(cpu, memAddress);
         accessMemory(cpu, index, instructionCache);
     } else {
         unsigned short tagFromCache = instructionCache[index].entryInfo & TAG_MASK;
@@ -119,44 +387,165 @@ void getInstruction(CPU_p cpu) {
         } else {
             instructionCache[index].entryInfo &= CLEAR_TAG_MASK; //Clear tag
             instructionCache[index].entryInfo = instructionCache[index].entryInfo | tagFromAddress;
+            PERF_COUNT(cpu, instructionCacheMisses, 1);
+            snoopInstructionFetch(cpu, memAddress);
             accessMemory(cpu, index, instructionCache);
         }
     }
+    pthread_mutex_unlock(&busLock);
+}
+
+//Returns 1 if the absolute address is one of the memory-mapped performance counter registers.
+int isPerfRegister(Register address) {
+    return address >= PERF_CYCLE_LO && address <= PERF_CONTROL;
+}
+
+//Returns a performance counter register as it stands, for the debugger. 32-bit counters are
+//split into low and high words.
+Register peekPerfRegister(CPU_p cpu, Register address) {
+    switch (address) {
+        case PERF_CYCLE_LO:
+            return cpu->perf.cycles & NEG_NUM_MASK;
+        case PERF_CYCLE_HI:
+            return (cpu->perf.cycles >> 16) & NEG_NUM_MASK;
+        case PERF_INSTRET_LO:
+            return cpu->perf.instructionsRetired & NEG_NUM_MASK;
+        case PERF_INSTRET_HI:
+            return (cpu->perf.instructionsRetired >> 16) & NEG_NUM_MASK;
+        case PERF_ICACHE_MISSES:
+            return cpu->perf.instructionCacheMisses & NEG_NUM_MASK;
+        case PERF_DCACHE_MISSES:
+            return cpu->perf.dataCacheMisses & NEG_NUM_MASK;
+        default:
+            return cpu->perf.control;
+    }
+}
+
+//Reads a performance counter register for the guest. Reading a low word latches the high word,
+//which the next read of the high word returns.
+Register readPerfRegister(CPU_p cpu, Register address) {
+    switch (address) {
+        case PERF_CYCLE_LO:
+            cpu->perf.cyclesHigh = peekPerfRegister(cpu, PERF_CYCLE_HI);
+            break;
+        case PERF_CYCLE_HI:
+            return cpu->perf.cyclesHigh;
+        case PERF_INSTRET_LO:
+            cpu->perf.instructionsRetiredHigh = peekPerfRegister(cpu, PERF_INSTRET_HI);
+            break;
+        case PERF_INSTRET_HI:
+            return cpu->perf.instructionsRetiredHigh;
+    }
+    return peekPerfRegister(cpu, address);
+}
+
+//Writes the performance counter control register. The counters themselves are read-only.
+void writePerfRegister(CPU_p cpu, Register address, Register value) {
+    if (address != PERF_CONTROL)
+        return;
+    if (value & PERF_RESET_BIT) {
+        cpu->perf.cycles = 0;
+        cpu->perf.instructionsRetired = 0;
+        cpu->perf.instructionCacheMisses = 0;
+        cpu->perf.dataCacheMisses = 0;
+        cpu->perf.cyclesHigh = 0;
+        cpu->perf.instructionsRetiredHigh = 0;
+    }
+    cpu->perf.control = value & PERF_FREEZE_BIT;
+}
+
+//Records a hit if the access to memAddress falls in a watchpoint of a matching type.
+void checkWatchpoint(Register memAddress, int access) {
+    int i;
+    for (i = 0; i < numWatchpoints; i++) {
+        Watchpoint *watch = &watchpoints[i];
+        if (memAddress >= watch->address && memAddress < watch->address + watch->length
+            && (watch->type == access || watch->type == WATCH_ACCESS)) {
+            watchHitType = watch->type;
+            watchHitAddress = memAddress;
+        }
+    }
 }
 
 //Writes data from the dataCache to the main memory.
 void writeToMemory(CPU_p cpu, Register writeAddress, Register cacheIndex) {
-    usleep(MICROSECONDS_TO_SLEEP); //Sleep because accessing memory.
-    memory[writeAddress] = dataCache[cacheIndex].data;
+    cpu->memoryStall += memoryLatency; //Accessing memory.
+    PERF_COUNT(cpu, cycles, MEMORY_ACCESS_CYCLES);
+    memory[writeAddress] = cpu->dataCache[cacheIndex].data;
+    coherenceStats.writeBacks++;
 }
 
 //Writes data to the cache and sets the appropriate bits. If a dirty bit is encountered, 
-//it initiates the write back (to memory) process by calling writeToMemory.
+//it initiates the write back (to memory) process by calling writeToMemory. Other cores'
+//copies are invalidated so this core ends up holding the line Modified.
 void writeData(CPU_p cpu) {
+    Cache_Entry *dataCache = cpu->dataCache;
     Register memAddress = cpu->MAR;
     Register index = memAddress % SIZE_OF_CACHE;
     Register tagFromAddress = memAddress / SIZE_OF_CACHE;
+    
+    if (isPerfRegister(cpu->MAR + cpu->origin)) { //Uncached device register.
+        writePerfRegister(cpu, cpu->MAR + cpu->origin, cpu->MDR);
+        return;
+    }
+    if (numWatchpoints > 0)
+        checkWatchpoint(memAddress, WATCH_WRITE);
+    
+    pthread_mutex_lock(&busLock);
     Register tagFromCache = dataCache[index].entryInfo & TAG_MASK;
+    int hit = (dataCache[index].entryInfo & VALID_BIT_MASK) && tagFromCache == tagFromAddress;
+    if (!hit)
+        PERF_COUNT(cpu, dataCacheMisses, 1);
     
     if (dataCache[index].entryInfo & DIRTY_BIT_MASK) { //If dirty bit is set need to write to mem.
         writeToMemory(cpu, (tagFromCache * SIZE_OF_CACHE) + index, index);
     }
     
+    if (!hit) { //Write miss, BusRdX.
+        coherenceStats.busReadXs++;
+        snoopBusInvalidate(cpu, memAddress);
+    } else if (dataCache[index].entryInfo & SHARED_BIT_MASK) { //Write hit on a Shared line, BusUpgr.
+        coherenceStats.busUpgrades++;
+        snoopBusInvalidate(cpu, memAddress);
+    }
+    
     dataCache[index].data = cpu->MDR;
-    dataCache[index].entryInfo = dataCache[index].entryInfo | (DIRTY_AND_VALID_BIT_MASK + tagFromAddress); //Set valid bit, dirty bit, and tag.           
+    dataCache[index].entryInfo &= ~(MESI_STATE_MASK | TAG_MASK);
+    dataCache[index].entryInfo = dataCache[index].entryInfo | (MODIFIED_STATE + tagFromAddress); //Set valid bit, dirty bit, and tag.           
+    if (isCodeAddress(memAddress)) { //Self-modifying code, write through so the refetch sees the new word.
+        memory[memAddress] = cpu->MDR;
+        dataCache[index].entryInfo &= ~DIRTY_BIT_MASK;
+        invalidateCode(memAddress);
+    }
+    pthread_mutex_unlock(&busLock);
 }
 
 //Loads data into the MDR using the address in the MAR. Checks the data cache, and accesses memory if a
-//read miss is encountered.
+//read miss is encountered. The line is filled Shared if another core holds a copy, Exclusive otherwise.
 void getData(CPU_p cpu) {
-    //entryInfo: (12 unused bits) + (1 bit valid bit) + (1 bit dirty bit) + (2 bits tag) 
+    //entryInfo: (11 unused bits) + (1 bit shared bit) + (1 bit valid bit) + (1 bit dirty bit) + (2 bits tag) 
+    Cache_Entry *dataCache = cpu->dataCache;
     Register memAddress = cpu->MAR;
     int index = memAddress % SIZE_OF_CACHE;
     unsigned short tagFromAddress = memAddress / SIZE_OF_CACHE;
+    
+    if (isPerfRegister(cpu->MAR + cpu->origin)) { //Uncached device register.
+        cpu->MDR = readPerfRegister(cpu, cpu->MAR + cpu->origin);
+        return;
+    }
+    if (numWatchpoints > 0)
+        checkWatchpoint(memAddress, WATCH_READ);
+    
+    pthread_mutex_lock(&busLock);
     unsigned short tagFromCache = dataCache[index].entryInfo & TAG_MASK;
     
     if (!(dataCache[index].entryInfo & VALID_BIT_MASK)) { //validBit not set, set valid bit and load data from mem into cache and the MDR.
+        coherenceStats.busReads++;
+        PERF_COUNT(cpu, dataCacheMisses, 1);
         dataCache[index].entryInfo = dataCache[index].entryInfo | (VALID_BIT_MASK + tagFromAddress);
+        if (snoopBusRead(cpu, memAddress)) {
+            dataCache[index].entryInfo |= SHARED_BIT_MASK;
+        }
         accessMemory(cpu, index, dataCache);
     } else if (tagFromCache == tagFromAddress) { //Read hit, load the MDR from the data cache.
             cpu->MDR = dataCache[index].data;
@@ -165,17 +554,82 @@ void getData(CPU_p cpu) {
             writeToMemory(cpu, (tagFromCache * SIZE_OF_CACHE) + index, index);
         }
     
-        dataCache[index].entryInfo &= CLEAR_TAG_AND_DIRTY_BIT_MASK; //Clear tag and dirty bit.
-        dataCache[index].entryInfo = dataCache[index].entryInfo | tagFromAddress;
+        coherenceStats.busReads++;
+        PERF_COUNT(cpu, dataCacheMisses, 1);
+        dataCache[index].entryInfo &= ~(MESI_STATE_MASK | TAG_MASK); //Clear state and tag.
+        dataCache[index].entryInfo = dataCache[index].entryInfo | (EXCLUSIVE_STATE + tagFromAddress);
+        if (snoopBusRead(cpu, memAddress)) {
+            dataCache[index].entryInfo |= SHARED_BIT_MASK;
+        }
         accessMemory(cpu, index, dataCache);
     }
+    pthread_mutex_unlock(&busLock);
+}
+
+//Executes the PUP instruction: pops M[R6] into Rd, or pushes Rd below R6.
+void pushOrPop(CPU_p cpu, Register Rd, int pop, unsigned short start_address) {
+    pthread_mutex_lock(&busLock); //PUP goes straight to memory, other cores still snoop it.
+    if(pop) { //Doing pop
+        if (numWatchpoints > 0)
+            checkWatchpoint(cpu->R6 - start_address, WATCH_READ);
+        snoopBusRead(cpu, cpu->R6 - start_address);
+        cpu->regFile[Rd] = memory[cpu->R6 - start_address];
+        cpu->R6++;
+    } else { //Doing push
+        cpu->R6--;
+        if (numWatchpoints > 0)
+            checkWatchpoint(cpu->R6 - start_address, WATCH_WRITE);
+        snoopBusInvalidate(cpu, cpu->R6 - start_address);
+        memory[cpu->R6 - start_address] = cpu->regFile[Rd];
+        if (isCodeAddress(cpu->R6 - start_address))
+            invalidateCode(cpu->R6 - start_address);
+    }                    
+    pthread_mutex_unlock(&busLock);
+}
+
+//Returns 1 if the trace filters let an instruction with this opcode through.
+int opcodeTraced(Register instruction) {
+    return (trace.opcodes >> (instruction >> OPCODE_SHIFT_AMT)) & 1;
+}
+
+//Returns 1 if an absolute address lies in the trace filter's range.
+int addressTraced(Register address) {
+    return address >= trace.low && address <= trace.high;
+}
+
+//Prints one line for an instruction that just completed: its address and word, then the registers.
+void traceInstruction(CPU_p cpu, Register address) {
+    int i;
+    monitor.onScreen = 0;
+    if (numCores > 1)
+        printf("[core %d] ", cpu->coreId);
+    printf("x%04X: x%04X ", address, cpu->IR);
+    for (i = 0; i < 8; i++) {
+        printf(" R%d:x%04X", i, cpu->regFile[i]);
+    }
+    printf("  CC:%c\n", cpu->CC & N ? 'N' : cpu->CC & Z ? 'Z' : 'P');
+}
+
+//Prints one data access made by the instruction at address, if the accessed word is in range.
+void traceAccess(CPU_p cpu, Register address, const char *kind, Register dataAddress, Register value) {
+    if (!addressTraced(dataAddress))
+        return;
+    monitor.onScreen = 0;
+    if (numCores > 1)
+        printf("[core %d] ", cpu->coreId);
+    printf("x%04X: %-5s x%04X = x%04X\n", address, kind, dataAddress, value);
 }
 
-//Executes instructions on our simulated CPU.
-int completeOneInstructionCycle(CPU_p cpu, ALU_p alu, unsigned short start_address) {
-    Register opcode, Rd, Rs1, Rs2, immed_offset, nzp, BEN, pcOffset, j; // fields for the IR
+//Executes instructions on our simulated CPU. Always inlined into one function per trace level,
+//so with a constant traceLevel every tracing check of the other levels compiles away.
+static inline __attribute__((always_inline))
+int instructionCycle(CPU_p cpu, ALU_p alu, unsigned short start_address, const int traceLevel) {
+    Register opcode, Rd, Rs1, Rs2, nzp, BEN, pcOffset; // fields for the IR
+    Register address = 0; //Absolute address of the instruction, for the trace.
+    int show = 0;         //The trace filters let this instruction through.
     int state = FETCH;
     while (state != DONE) {
+        PERF_COUNT(cpu, cycles, 1); //One cycle per microstate.
         switch (state) {
             case FETCH: // microstates 18, 33, 35 in the book
                 cpu->MAR = cpu->PC;
@@ -183,12 +637,14 @@ int completeOneInstructionCycle(CPU_p cpu, ALU_p alu, unsigned short start_addre
                 getInstruction(cpu);
                 //cpu->MDR = memory[cpu->MAR];
                 cpu->IR = cpu->MDR;
+                if (traceLevel != TRACE_OFF) {
+                    address = cpu->MAR + start_address;
+                    show = opcodeTraced(cpu->IR) && (traceLevel == TRACE_MEMORY || addressTraced(address));
+                }
 
                 //+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
-                #if DEBUG == 1
-                printf("\n===========FETCH==============\n");
-                printCurrentState(cpu,alu, 0, DEFAULT_ADDRESS);
-                #endif
+                if (traceLevel == TRACE_MICROSTATE && show)
+                    traceState("===========FETCH==============", cpu, alu);
                 //+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
                 state = DECODE;
                 break;
@@ -235,10 +691,8 @@ int completeOneInstructionCycle(CPU_p cpu, ALU_p alu, unsigned short start_addre
                 }
 
                 //+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
-                #if DEBUG == 1
-                printf("\n===========DECODE==============\n");
-                printCurrentState(cpu, alu, 0, DEFAULT_ADDRESS);
-                #endif
+                if (traceLevel == TRACE_MICROSTATE && show)
+                    traceState("===========DECODE==============", cpu, alu);
                 //+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
 
                 state = EVAL_ADDR;
@@ -264,6 +718,8 @@ int completeOneInstructionCycle(CPU_p cpu, ALU_p alu, unsigned short start_addre
                     case STI:
                         cpu->MAR = cpu->PC + pcOffset;
                         getData(cpu);
+                        if (traceLevel == TRACE_MEMORY && show)
+                            traceAccess(cpu, address, "read", cpu->MAR + start_address, cpu->MDR);
                         //cpu->MDR = memory[memory[cpu->MAR]];
                         cpu->MAR = cpu->MDR - start_address;
                         break;
@@ -272,10 +728,8 @@ int completeOneInstructionCycle(CPU_p cpu, ALU_p alu, unsigned short start_addre
                 }
 
                 //+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
-                #if DEBUG == 1
-                printf("\n===========EVAL_ADDR==============\n");
-                printCurrentState(cpu, alu, 0, DEFAULT_ADDRESS);
-                #endif
+                if (traceLevel == TRACE_MICROSTATE && show)
+                    traceState("===========EVAL_ADDR==============", cpu, alu);
                 //+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
 
                 state = FETCH_OP;
@@ -302,6 +756,8 @@ int completeOneInstructionCycle(CPU_p cpu, ALU_p alu, unsigned short start_addre
                     case LDI:
                         //cpu->MDR = memory[cpu->MAR];
                         getData(cpu);
+                        if (traceLevel == TRACE_MEMORY && show)
+                            traceAccess(cpu, address, "read", cpu->MAR + start_address, cpu->MDR);
                         break;
                     case ST:
                     case STR:
@@ -312,10 +768,8 @@ int completeOneInstructionCycle(CPU_p cpu, ALU_p alu, unsigned short start_addre
                         break;
                     }
                 //+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
-                #if DEBUG == 1
-                printf("\n===========FETCH_OP==============\n");
-                printCurrentState(cpu, alu, 0, DEFAULT_ADDRESS);
-                #endif
+                if (traceLevel == TRACE_MICROSTATE && show)
+                    traceState("===========FETCH_OP==============", cpu, alu);
                 //+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
 
                 state = EXECUTE;
@@ -335,8 +789,12 @@ int completeOneInstructionCycle(CPU_p cpu, ALU_p alu, unsigned short start_addre
                         setCC(alu->R, cpu);
                         break;
                     case TRAP:
-                        if (trap(cpu->MAR, cpu) == HALT) //checks if program should halt
+                        if (trap(cpu->MAR, cpu, address, traceLevel == TRACE_MEMORY && show) == HALT) { //checks if program should halt
+                            PERF_COUNT(cpu, instructionsRetired, 1);
+                            if (traceLevel == TRACE_INSTRUCTION && show)
+                                traceInstruction(cpu, address);
                             return HALT;
+                        }
                         break;
                     case JMP:
                         cpu->PC = cpu->regFile[Rs1];
@@ -350,22 +808,18 @@ int completeOneInstructionCycle(CPU_p cpu, ALU_p alu, unsigned short start_addre
                         }
                         break;
                     case PUP:
-                        if(cpu->IR & POP_MASK) { //Doing pop
-                            cpu->regFile[Rd] = memory[cpu->R6 - start_address];
-                            cpu->R6++;
-                        } else { //Doing push
-                            cpu->R6--;
-                            memory[cpu->R6 - start_address] = cpu->regFile[Rd];
-                        }                    
+                        pushOrPop(cpu, Rd, cpu->IR & POP_MASK, start_address);
+                        if (traceLevel == TRACE_MEMORY && show && (cpu->IR & POP_MASK))
+                            traceAccess(cpu, address, "pop", cpu->R6 - 1, cpu->regFile[Rd]);
+                        else if (traceLevel == TRACE_MEMORY && show)
+                            traceAccess(cpu, address, "push", cpu->R6, cpu->regFile[Rd]);
                         break;
                     default:
                         break;
                 }
                 //+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
-                #if DEBUG == 1
-                printf("\n===========EXECUTE==============\n");
-                printCurrentState(cpu, alu, 0, DEFAULT_ADDRESS);
-                #endif
+                if (traceLevel == TRACE_MICROSTATE && show)
+                    traceState("===========EXECUTE==============", cpu, alu);
                 //+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
 
                 state = STORE;
@@ -392,6 +846,8 @@ int completeOneInstructionCycle(CPU_p cpu, ALU_p alu, unsigned short start_addre
                     case STI:
                         writeData(cpu);                    
                         //memory[cpu->MAR] = cpu->MDR;
+                        if (traceLevel == TRACE_MEMORY && show)
+                            traceAccess(cpu, address, "write", cpu->MAR + start_address, cpu->MDR);
                         break;
                     case LEA:
                         cpu->regFile[Rd] = cpu->PC + pcOffset;
@@ -405,49 +861,200 @@ int completeOneInstructionCycle(CPU_p cpu, ALU_p alu, unsigned short start_addre
                 break;
         }
     }
+    PERF_COUNT(cpu, instructionsRetired, 1);
+    if (traceLevel == TRACE_INSTRUCTION && show)
+        traceInstruction(cpu, address);
     return 0;
 }
 
-//Prints the debug monitor (registers, both caches, and some of the memory)
-void printCurrentState(CPU_p cpu, ALU_p alu, int mem_Offset, unsigned short start_address) {
-  int i , j, temp;
+int cycleTraceOff(CPU_p cpu, ALU_p alu, unsigned short start_address) {
+    return instructionCycle(cpu, alu, start_address, TRACE_OFF);
+}
+
+int cycleTraceInstructions(CPU_p cpu, ALU_p alu, unsigned short start_address) {
+    return instructionCycle(cpu, alu, start_address, TRACE_INSTRUCTION);
+}
+
+int cycleTraceMicrostates(CPU_p cpu, ALU_p alu, unsigned short start_address) {
+    return instructionCycle(cpu, alu, start_address, TRACE_MICROSTATE);
+}
+
+int cycleTraceMemory(CPU_p cpu, ALU_p alu, unsigned short start_address) {
+    return instructionCycle(cpu, alu, start_address, TRACE_MEMORY);
+}
+
+//The reference engine, the instructionCycle variant built for the current trace level.
+int (*completeOneInstructionCycle)(CPU_p cpu, ALU_p alu, unsigned short start_address) = cycleTraceOff;
+
+//Switches the reference engine to the variant for a trace level.
+void setTraceLevel(int level) {
+    static int (*const variants[NUM_TRACE_LEVELS])(CPU_p, ALU_p, unsigned short) = {
+        cycleTraceOff, cycleTraceInstructions, cycleTraceMicrostates, cycleTraceMemory
+    };
+    trace.level = level;
+    completeOneInstructionCycle = variants[level];
+}
+
+//RUN has to go through the reference engine when it is told to, or when it is tracing: the
+//superblocks and fast-forwarding skip the trace points.
+int useReferenceEngine() {
+    return referenceOnly || trace.level != TRACE_OFF;
+}
+
+//Appends to a monitor row, highlighted if changed is set.
+char *monitorAppend(char *out, int changed, const char *format, ...) {
+    va_list args;
+    if (changed)
+        out += sprintf(out, HIGHLIGHT_ON);
+    va_start(args, format);
+    out += vsprintf(out, format, args);
+    va_end(args);
+    if (changed)
+        out += sprintf(out, HIGHLIGHT_OFF);
+    return out;
+}
+
+//Builds the column headings and DISPLAY_SIZE rows of the debug monitor (registers, both caches,
+//and some of the memory). Values that differ from the last frame of the same core are highlighted.
+void buildMonitorRows(char rows[][MONITOR_ROW_SIZE], CPU_p cpu, ALU_p alu, int mem_Offset, unsigned short start_address) {
+  int i , j, k, temp;
   int numOfRegisters = sizeof(cpu->regFile)/sizeof(cpu->regFile[0]);
-  printf("Registers            Instruction Cache               Memory\n");
+  int changes = monitor.interactive && monitor.hasSnapshot && monitor.cpu.coreId == cpu->coreId;
+  CPU_p last = &monitor.cpu;
+  char *out;
+  strcpy(rows[0], "Registers            Instruction Cache               Memory");
   for (i = 0, j = mem_Offset; i < DISPLAY_SIZE; i++, j++) {
+    out = rows[i + 1];
     temp = i * NUM_INST_CACHE_LINES;
     if(i < numOfRegisters) {
-      printf("R%d: x%04X     ", i, cpu->regFile[i] & NEG_NUM_MASK);  //don't use leading 4 bits
+      out += sprintf(out, "R%d: ", i);
+      out = monitorAppend(out, changes && cpu->regFile[i] != last->regFile[i], "x%04X", cpu->regFile[i] & NEG_NUM_MASK);  //don't use leading 4 bits
+      out += sprintf(out, "     ");
       if (i < NUM_INST_CACHE_LINES) { //Instruction cache contents
-          printf("x%04X: x%04X x%04X x%04X x%04X      ", start_address + temp, instructionCache[temp].data, instructionCache[temp + 1].data, instructionCache[temp + 2].data, instructionCache[temp + 3].data);
+          out += sprintf(out, "x%04X:", start_address + temp);
+          for (k = temp; k < temp + NUM_WORDS_IN_BLOCK; k++) {
+              out += sprintf(out, " ");
+              out = monitorAppend(out, changes && cpu->instructionCache[k].data != monitor.instructionCache[k], "x%04X", cpu->instructionCache[k].data);
+          }
+          out += sprintf(out, "      ");
       } else if (i == NUM_INST_CACHE_LINES) { //Data cache header
-          printf("         Data L1 Cache              ");
+          out += sprintf(out, "         Data L1 Cache              ");
       }                  
     } else if (i < NUM_DATA_CACHE_LINES) { //Print cache stuff
-        printf("              ");
+        out += sprintf(out, "              ");
     } else if (i == NUM_DATA_CACHE_LINES) { //print PC, IR, etc...
-        printf("PC:x%04X  IR:x%04X  A: x%04X  B: x%04X            ",cpu->PC + start_address, cpu->IR, alu->A  & NEG_NUM_MASK, alu->B & NEG_NUM_MASK);
+        out += sprintf(out, "PC:");
+        out = monitorAppend(out, changes && cpu->PC != last->PC, "x%04X", cpu->PC + start_address);
+        out += sprintf(out, "  IR:");
+        out = monitorAppend(out, changes && cpu->IR != last->IR, "x%04X", cpu->IR);
+        out += sprintf(out, "  A: ");
+        out = monitorAppend(out, changes && alu->A != monitor.alu.A, "x%04X", alu->A & NEG_NUM_MASK);
+        out += sprintf(out, "  B: ");
+        out = monitorAppend(out, changes && alu->B != monitor.alu.B, "x%04X", alu->B & NEG_NUM_MASK);
+        out += sprintf(out, "            ");
     } else if (i == NUM_DATA_CACHE_LINES + 1) {
-        printf("MAR: x%04X MDR: x%04X CC: N:%d Z:%d P:%d             ",cpu->MAR + start_address, cpu->MDR & NEG_NUM_MASK, (cpu->CC & NEG_BIT_MASK) > 0, (cpu->CC & ZERO_BIT_MASK) > 0, (cpu->CC & 1) > 0);
+        out += sprintf(out, "MAR: ");
+        out = monitorAppend(out, changes && cpu->MAR != last->MAR, "x%04X", cpu->MAR + start_address);
+        out += sprintf(out, " MDR: ");
+        out = monitorAppend(out, changes && cpu->MDR != last->MDR, "x%04X", cpu->MDR & NEG_NUM_MASK);
+        out += sprintf(out, " CC: ");
+        out = monitorAppend(out, changes && cpu->CC != last->CC, "N:%d Z:%d P:%d", (cpu->CC & NEG_BIT_MASK) > 0, (cpu->CC & ZERO_BIT_MASK) > 0, (cpu->CC & 1) > 0);
+        out += sprintf(out, "             ");
     } else {
-        printf("                                                  ");
+        out += sprintf(out, "                                                  ");
     }
     
     if (i < NUM_DATA_CACHE_LINES && i > NUM_INST_CACHE_LINES) { //Data cache contents
-        printf("x%04X: x%04X x%04X x%04X x%04X      ", start_address + DATA_CACHE_OFFSET + ((i - (NUM_INST_CACHE_LINES + 1)) * NUM_INST_CACHE_LINES), dataCache[temp].data, dataCache[temp + 1].data, dataCache[temp + 2].data, dataCache[temp + 3].data);
+        out += sprintf(out, "x%04X:", start_address + DATA_CACHE_OFFSET + ((i - (NUM_INST_CACHE_LINES + 1)) * NUM_INST_CACHE_LINES));
+        for (k = temp; k < temp + NUM_WORDS_IN_BLOCK; k++) {
+            out += sprintf(out, " ");
+            out = monitorAppend(out, changes && cpu->dataCache[k].data != monitor.dataCache[k], "x%04X", cpu->dataCache[k].data);
+        }
+        out += sprintf(out, "      ");
     }
     
     if(j < SIZE_OF_MEM && j >= 0){
-      printf("x%04X: x%04X", j + start_address, memory[j]);
+      out += sprintf(out, "x%04X: ", j + start_address);
+      out = monitorAppend(out, changes && mem_Offset == monitor.memOffset && memory[j] != monitor.memory[i], "x%04X", memory[j]);
       Register index = j % SIZE_OF_CACHE;
     
-      if (dataCache[index].entryInfo & DIRTY_BIT_MASK) { //If dirty bit set need to write to mem.
-          printf("  *D*");
+      if (cpu->dataCache[index].entryInfo & DIRTY_BIT_MASK) { //If dirty bit set need to write to mem.
+          out += sprintf(out, "  *D*");
+      }
+      if (symbolAt(j + start_address) != NULL) {
+          snprintf(out, MONITOR_ROW_SIZE - (out - rows[i + 1]), "  %s", symbolAt(j + start_address));
       }
-      printf("\n");
     } else {
-      printf("x%04X: x0000\n", j + start_address);
+      sprintf(out, "x%04X: x0000", j + start_address);
+    }
+  }
+}
+
+//Remembers the values just shown, the next frame highlights what differs from them.
+void takeMonitorSnapshot(CPU_p cpu, ALU_p alu, int mem_Offset) {
+  int i;
+  monitor.cpu = *cpu;
+  monitor.alu = *alu;
+  for (i = 0; i < DISPLAY_SIZE * NUM_WORDS_IN_BLOCK; i++) {
+    monitor.instructionCache[i] = cpu->instructionCache[i].data;
+    monitor.dataCache[i] = cpu->dataCache[i].data;
+  }
+  for (i = 0; i < DISPLAY_SIZE; i++) {
+    monitor.memory[i] = mem_Offset + i >= 0 && mem_Offset + i < SIZE_OF_MEM ? memory[mem_Offset + i] : 0;
+  }
+  monitor.memOffset = mem_Offset;
+  monitor.hasSnapshot = 1;
+}
+
+//Prints the debug monitor under a title line. On a terminal the frame stays at the top of the
+//screen and only rows that differ from what is already there are rewritten; the cursor is left
+//under it with the rest of the screen cleared. Otherwise every row is printed.
+void printCurrentState(const char *title, CPU_p cpu, ALU_p alu, int mem_Offset, unsigned short start_address) {
+  char rows[DISPLAY_SIZE + 2][MONITOR_ROW_SIZE];
+  int i;
+  snprintf(rows[0], MONITOR_ROW_SIZE, "%s", title);
+  buildMonitorRows(rows + 1, cpu, alu, mem_Offset, start_address);
+  if (!monitor.interactive) {
+    for (i = 0; i < DISPLAY_SIZE + 2; i++) {
+      printf("%s\n", rows[i]);
+    }
+  } else {
+    struct winsize window;
+    if (ioctl(1, TIOCGWINSZ, &window) == 0 && window.ws_row < MONITOR_TOP_ROW + DISPLAY_SIZE + 2 + MONITOR_MENU_ROWS)
+      monitor.onScreen = 0; //The menu under the frame scrolls it off, redraw it whole every time.
+    if (!monitor.onScreen)
+      printf("\033[H\033[2J");
+    for (i = 0; i < DISPLAY_SIZE + 2; i++) {
+      if (!monitor.onScreen || strcmp(rows[i], monitor.rows[i]) != 0) {
+        printf("\033[%d;1H%s\033[K", MONITOR_TOP_ROW + i, rows[i]);
+        strcpy(monitor.rows[i], rows[i]);
+      }
     }
+    printf("\033[%d;1H\033[J", MONITOR_TOP_ROW + DISPLAY_SIZE + 2);
+    fflush(stdout);
+    monitor.onScreen = 1;
+  }
+  takeMonitorSnapshot(cpu, alu, mem_Offset);
+}
+
+//Milliseconds from a monotonic clock.
+unsigned long monitorClock() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000UL + now.tv_nsec / 1000000;
+}
+
+//Draws the monitor from inside the instruction cycle. While RUN is going at most one frame per
+//MONITOR_FRAME_INTERVAL_MS is drawn, so tracing does not hold back execution.
+void traceState(const char *title, CPU_p cpu, ALU_p alu) {
+  unsigned long now;
+  if (monitor.running) {
+    now = monitorClock();
+    if (now - monitor.lastFrame < MONITOR_FRAME_INTERVAL_MS)
+      return;
+    monitor.lastFrame = now;
   }
+  printCurrentState(title, cpu, alu, 0, cpu->origin);
 }
 
 //Handles user input when an error message tells them
@@ -504,146 +1111,3144 @@ void printCurrentBreakpoints(Register breakpoints[], int start_address) {
     int i;
     for (i = 0; i < MAX_NUM_BKPTS; i++) {
         if (breakpoints[i] != DEFAULT_BKPT_VALUE) {
-            printf("x%04X\n", breakpoints[i] + start_address);
+            printf("x%04X", breakpoints[i] + start_address);
+            if (symbolAt(breakpoints[i] + start_address) != NULL)
+                printf(" %s", symbolAt(breakpoints[i] + start_address));
+            printf("\n");
         }
     }
     
     printf("===================================\n\n");
 }
 
-int main(int argc, char * argv[]) {
-    CPU_p cpu_pointer = malloc(sizeof(struct CPU_s));
-    ALU_p alu_pointer = malloc(sizeof(struct ALU_s));
-    cpu_pointer->PC = 0;
-    cpu_pointer->CC = Z;
-    char input[INPUT_SIZE];
-    char file_name[INPUT_SIZE];
-    int choice;
-    char buf[5];
-    char *temp;
-    int temp_offset;
-    int offset = 0;
-    int save_temp = 0;
-    unsigned short start_address = DEFAULT_ADDRESS;
-    int loadedProgram = 0;
-    int programHalted = 0;
-    int n;
-    int owCheck;
-    int saveCheck = 1;
-    unsigned int start, end;
-    Register breakpoints[MAX_NUM_BKPTS];
-    int numBreakpoints = 0;
-    clearBreakpoints(breakpoints);
-    initializeCaches();
+//Prints an assembler error with the file and line it came from.
+void asmError(const char *fileName, Asm_Line *line, const char *format, ...) {
+    va_list args;
+    printf("Error: %s:%d: ", fileName, line->number);
+    va_start(args, format);
+    vprintf(format, args);
+    va_end(args);
+    printf("\n");
+}
 
-  while (1) {
-    printf("           Welcome to the LC-3 Simulator Simulator\n");
-	  printCurrentState(cpu_pointer, alu_pointer, offset, start_address);
-	  printf("Select: 1) Load, 2) Save, 3) Step, 4) Run, 5) Display Mem, 6) Edit, 7) Set Bkpt, 8) Unset Bkpt, 9) Exit\n> ");
-    scanf("%d", &choice);
-    switch(choice){
-      case LOAD:
-        printf("File name: ");
-        scanf("%s", input);
-        FILE *fp = fopen(input, "r");
-        if(fp == NULL){
-          printf("Error: File not found. Press <ENTER> to continue");
-          getEnterInput();
-        } else {
-          int i = 0;
-          while(!feof(fp)) {
-            if(i == 0){
-              fgets(buf, 5, fp);
-              start_address = strtol(buf, &temp, STRTOL_BASE);
-              fgets(buf,3, fp);
-            }
-            fgets(buf, 5, fp);
-            if(i >= SIZE_OF_MEM){
-              printf("Error: Not enough memory");
-              break;
-            }
-            memory[i] = strtol(buf, &temp, STRTOL_BASE);
-            i++;
-            fgets(buf,3, fp);
-          }
-          fclose(fp);
-          loadedProgram = 1;
-          programHalted = 0;
-          numBreakpoints = 0;
-          clearBreakpoints(breakpoints);
-          initializeCaches();
-          //Initialize cpu fields;
-          cpu_pointer->PC = 0;
-          cpu_pointer->CC = Z;
-        }
-        break;
-      case STEP:
-        if (loadedProgram == 1) {
-          int response = completeOneInstructionCycle(cpu_pointer, alu_pointer, start_address);
-          if (response == HALT) {
-            loadedProgram = 0;
-            programHalted = 1;                        
-            printf("\n======Program halted.======\nPress <ENTER> to continue.");
-            numBreakpoints = 0;
-            clearBreakpoints(breakpoints);
-            getEnterInput();
-          }
-        } else if (programHalted == 1){
-          printf("Your program has halted. Please load another program. \nPress <ENTER> to continue.");
-          getEnterInput();
-        } else {
-          printf("Please load a program first. Press <ENTER> to continue");
-          getEnterInput();
+//Returns the TRAP vector of a trap alias such as HALT, or -1.
+int trapAlias(const char *token) {
+    static const char *names[] = {"GETC", "OUT", "PUTS", "IN", "PUTSP", "HALT", "SWAP", "CPUID"};
+    static const int vectors[] = {GETC, OUT, PUTS, IN, PUTSP, HALT, SWAP, CPUID};
+    int i;
+    for (i = 0; i < (int) (sizeof(vectors) / sizeof(vectors[0])); i++) {
+        if (strcasecmp(token, names[i]) == 0)
+            return vectors[i];
+    }
+    return -1;
+}
+
+//Returns the nzp bits of a BR mnemonic (BR alone means BRnzp), or -1 if it is not one.
+int branchCondition(const char *token) {
+    int nzp = 0;
+    if (strncasecmp(token, "BR", 2) != 0)
+        return -1;
+    for (token += 2; *token; token++) {
+        switch (tolower((unsigned char) *token)) {
+            case 'n': nzp |= N; break;
+            case 'z': nzp |= Z; break;
+            case 'p': nzp |= P; break;
+            default: return -1;
         }
-        break;
-      case RUN:
-        if (loadedProgram == 1) {
-          int response = completeOneInstructionCycle(cpu_pointer, alu_pointer, start_address);
-          int reachedBreakpoint = hitBreakpoint(breakpoints, cpu_pointer->PC, &numBreakpoints, 1);
-          while (response != HALT && !reachedBreakpoint && cpu_pointer->PC != SIZE_OF_MEM) {
-            response = completeOneInstructionCycle(cpu_pointer, alu_pointer, start_address);
-            reachedBreakpoint = hitBreakpoint(breakpoints, cpu_pointer->PC, &numBreakpoints, 1);
-          }
-          
-          if (reachedBreakpoint) {
-              printf("Reached breakpoint: x%04X\nPress <ENTER> to return to the menu.", cpu_pointer->PC + start_address);
-              getEnterInput();
-          } else {
-            loadedProgram = 0;
-            programHalted = 1;
-            
-            if (cpu_pointer->PC == SIZE_OF_MEM)
-              printf("\n======= END OF MEMORY REACHED =======\nPlease include a HALT in your program to prevent this from happening.\nPress <ENTER> to continue.");
-            else
-              printf("\n======Program halted.======\nPress <ENTER> to continue.");
-            numBreakpoints = 0;
-            clearBreakpoints(breakpoints);
-            getEnterInput();
-          }
-        } else if (programHalted == 1){
-          printf("Your program has halted. Please load another program.\nPress <ENTER> to continue.");
-          getEnterInput();
-        } else {
-          printf("Please load a program first. Press <ENTER> to continue.");
-          getEnterInput();
+    }
+    return nzp == 0 ? N | Z | P : nzp;
+}
+
+//Returns the opcode of a mnemonic, or -1. Directives and trap aliases count as mnemonics too.
+int mnemonicOpcode(const char *token) {
+    static const char *names[] = {"ADD", "AND", "NOT", "LD", "ST", "LDR", "STR", "LDI", "STI", "LEA",
+                                  "JMP", "RET", "JSR", "JSRR", "TRAP", "RTI", "PUP"};
+    static const int opcodes[] = {ADD, AND, NOT, LD, ST, LDR, STR, LDI, STI, LEA,
+                                  JMP, RET, JSR, JSR, TRAP, 8, PUP};
+    int i;
+    if (token[0] == '.' || trapAlias(token) >= 0)
+        return TRAP;
+    if (branchCondition(token) >= 0)
+        return BR;
+    for (i = 0; i < (int) (sizeof(opcodes) / sizeof(opcodes[0])); i++) {
+        if (strcasecmp(token, names[i]) == 0)
+            return opcodes[i];
+    }
+    return -1;
+}
+
+//Parses #decimal, xHEX, 0xHEX or a bare decimal number. Returns 1 on success.
+int parseNumber(const char *token, int *value) {
+    const char *digits = token;
+    int base = 10;
+    char *end;
+    if (token[0] == '#') {
+        digits = token + 1;
+    } else if (token[0] == 'x' || token[0] == 'X') {
+        digits = token + 1;
+        base = STRTOL_BASE;
+    } else if (token[0] == '0' && (token[1] == 'x' || token[1] == 'X')) {
+        digits = token + 2;
+        base = STRTOL_BASE;
+    } else if (!isdigit((unsigned char) token[0]) && token[0] != '-') {
+        return 0;
+    }
+    *value = strtol(digits, &end, base);
+    return end != digits && *end == '\0';
+}
+
+//Parses R0 through R7. Returns the register number or -1.
+int parseRegister(const char *token) {
+    if ((token[0] == 'R' || token[0] == 'r') && token[1] >= '0' && token[1] <= '7' && token[2] == '\0')
+        return token[1] - '0';
+    return -1;
+}
+
+//Splits a line into tokens in place. Comments start at ';' or "//", operands are separated by
+//commas and/or whitespace, and the quoted operand of .STRINGZ is unescaped into line->string.
+//Returns 0, or -1 if the line has too many tokens or an unterminated string.
+int tokenizeLine(char *text, Asm_Line *line) {
+    char *p = text, *out;
+    line->numTokens = 0;
+    line->string = NULL;
+    while (*p) {
+        if (*p == ';' || (p[0] == '/' && p[1] == '/'))
+            break;
+        if (isspace((unsigned char) *p) || *p == ',') {
+            *p++ = '\0';
+            continue;
         }
-        break;
-      case DISPLAY_MEM:
-        printf("Starting Address: ");
-        scanf("%s", input);
-        temp_offset = strtol(input, &temp, STRTOL_BASE);
-        if(temp_offset < 0 || temp_offset >= NEG_NUM_MASK){
-          printf("Not a valid address <ENTER> to continue.");
-          getEnterInput();
-        } else {
-          offset = temp_offset - start_address;
+        if (*p == '"') { //String operand, unescaped in place.
+            line->string = out = ++p;
+            while (*p && *p != '"') {
+                if (*p == '\\' && p[1]) {
+                    p++;
+                    *out++ = *p == 'n' ? '\n' : *p == 't' ? '\t' : *p == '0' ? '\0' : *p;
+                    p++;
+                } else {
+                    *out++ = *p++;
+                }
+            }
+            if (*p != '"')
+                return -1;
+            line->stringLength = out - line->string;
+            *out = '\0';
+            p++;
+            continue;
         }
-        break;
-	  case EDIT:
-		  printf("The memory address to be edited: ");
-		  scanf("%s", input);
-		  temp_offset = strtol(input, &temp, STRTOL_BASE) - start_address;
-		  if (temp_offset >= SIZE_OF_MEM || temp_offset < 0) {
+        if (line->numTokens == MAX_TOKENS)
+            return -1;
+        line->tokens[line->numTokens++] = p;
+        while (*p && !isspace((unsigned char) *p) && *p != ',' && *p != ';' && *p != '"')
+            p++;
+    }
+    *p = '\0';
+    return 0;
+}
+
+//Encodes a PC-relative operand (a label or a literal offset) into a field of the given width.
+int encodeOffset(const char *fileName, Asm_Line *line, const char *token, int bits, Register *field) {
+    int value;
+    Symbol *symbol = findSymbol(token);
+    if (symbol != NULL) {
+        value = (short) (symbol->address - (line->address + 1));
+    } else if (!parseNumber(token, &value)) {
+        asmError(fileName, line, "undefined label '%s'", token);
+        return -1;
+    }
+    if (value < -(1 << (bits - 1)) || value >= (1 << (bits - 1))) {
+        asmError(fileName, line, "'%s' is out of range of a %d-bit offset", token, bits);
+        return -1;
+    }
+    *field = value & ((1 << bits) - 1);
+    return 0;
+}
+
+//Encodes a signed immediate; hex values such as xFFF6 are read as 16-bit two's complement.
+int encodeImmediate(const char *fileName, Asm_Line *line, const char *token, int bits, Register *field) {
+    int value;
+    if (!parseNumber(token, &value)) {
+        asmError(fileName, line, "expected a number, found '%s'", token);
+        return -1;
+    }
+    if (value > 0x7FFF && value <= NEG_NUM_MASK)
+        value -= NEG_NUM_MASK + 1;
+    if (value < -(1 << (bits - 1)) || value >= (1 << (bits - 1))) {
+        asmError(fileName, line, "%s does not fit in %d bits", token, bits);
+        return -1;
+    }
+    *field = value & ((1 << bits) - 1);
+    return 0;
+}
+
+//Returns register operand i of the line, printing an error and returning -1 if it is not a register.
+int operandRegister(const char *fileName, Asm_Line *line, int i) {
+    int reg = i < line->numTokens ? parseRegister(line->tokens[i]) : -1;
+    if (reg < 0)
+        asmError(fileName, line, "expected a register as operand %d", i);
+    return reg;
+}
+
+//Encodes one instruction whose mnemonic is tokens[0]. Returns 0, or -1 after printing an error.
+int encodeInstruction(const char *fileName, Asm_Line *line, Register *word) {
+    char **tokens = line->tokens;
+    int opcode = mnemonicOpcode(tokens[0]);
+    int nzp = branchCondition(tokens[0]);
+    int vector = trapAlias(tokens[0]);
+    int Rd, Rs1, Rs2, value;
+    Register field;
+    
+    if (opcode < 0) {
+        asmError(fileName, line, "unknown instruction '%s'", tokens[0]);
+        return -1;
+    }
+    if (vector >= 0) {
+        *word = (TRAP << OPCODE_SHIFT_AMT) | vector;
+        return 0;
+    }
+    if (nzp >= 0) {
+        if (line->numTokens < 2 || encodeOffset(fileName, line, tokens[1], 9, &field) < 0)
+            return line->numTokens < 2 ? (asmError(fileName, line, "missing branch target"), -1) : -1;
+        *word = (nzp << DEST_REG_SHIFT_AMT) | field;
+        return 0;
+    }
+    *word = opcode << OPCODE_SHIFT_AMT;
+    switch (opcode) {
+        case ADD:
+        case AND:
+            if ((Rd = operandRegister(fileName, line, 1)) < 0 || (Rs1 = operandRegister(fileName, line, 2)) < 0)
+                return -1;
+            if (line->numTokens < 4) {
+                asmError(fileName, line, "missing third operand");
+                return -1;
+            }
+            *word |= (Rd << DEST_REG_SHIFT_AMT) | (Rs1 << SOURCE1_SHIFT_AMT);
+            if ((Rs2 = parseRegister(tokens[3])) >= 0) {
+                *word |= Rs2;
+            } else {
+                if (encodeImmediate(fileName, line, tokens[3], 5, &field) < 0)
+                    return -1;
+                *word |= BIT_5_MASK | field;
+            }
+            return 0;
+        case NOT:
+            if ((Rd = operandRegister(fileName, line, 1)) < 0 || (Rs1 = operandRegister(fileName, line, 2)) < 0)
+                return -1;
+            *word |= (Rd << DEST_REG_SHIFT_AMT) | (Rs1 << SOURCE1_SHIFT_AMT) | PCOFFSET6_MASK;
+            return 0;
+        case LD:
+        case ST:
+        case LDI:
+        case STI:
+        case LEA:
+            if ((Rd = operandRegister(fileName, line, 1)) < 0)
+                return -1;
+            if (line->numTokens < 3) {
+                asmError(fileName, line, "missing address operand");
+                return -1;
+            }
+            if (encodeOffset(fileName, line, tokens[2], 9, &field) < 0)
+                return -1;
+            *word |= (Rd << DEST_REG_SHIFT_AMT) | field;
+            return 0;
+        case LDR:
+        case STR:
+            if ((Rd = operandRegister(fileName, line, 1)) < 0 || (Rs1 = operandRegister(fileName, line, 2)) < 0)
+                return -1;
+            if (line->numTokens < 4) {
+                asmError(fileName, line, "missing offset operand");
+                return -1;
+            }
+            if (encodeImmediate(fileName, line, tokens[3], 6, &field) < 0)
+                return -1;
+            *word |= (Rd << DEST_REG_SHIFT_AMT) | (Rs1 << SOURCE1_SHIFT_AMT) | field;
+            return 0;
+        case JMP: //Also RET
+            if (strcasecmp(tokens[0], "RET") == 0) {
+                *word |= 7 << SOURCE1_SHIFT_AMT;
+                return 0;
+            }
+            if ((Rs1 = operandRegister(fileName, line, 1)) < 0)
+                return -1;
+            *word |= Rs1 << SOURCE1_SHIFT_AMT;
+            return 0;
+        case JSR: //Also JSRR
+            if (strcasecmp(tokens[0], "JSRR") == 0) {
+                if ((Rs1 = operandRegister(fileName, line, 1)) < 0)
+                    return -1;
+                *word |= Rs1 << SOURCE1_SHIFT_AMT;
+                return 0;
+            }
+            if (line->numTokens < 2) {
+                asmError(fileName, line, "missing subroutine label");
+                return -1;
+            }
+            if (encodeOffset(fileName, line, tokens[1], 11, &field) < 0)
+                return -1;
+            *word |= BIT_11_MASK | field;
+            return 0;
+        case TRAP:
+            if (line->numTokens < 2 || !parseNumber(tokens[1], &value) || value < 0 || value > TRAP_VECTOR_8_MASK) {
+                asmError(fileName, line, "expected a trap vector between x00 and xFF");
+                return -1;
+            }
+            *word |= value;
+            return 0;
+        case PUP: //PUP Rd[, PUSH | POP]
+            if ((Rd = operandRegister(fileName, line, 1)) < 0)
+                return -1;
+            *word |= Rd << DEST_REG_SHIFT_AMT;
+            if (line->numTokens > 2 && strcasecmp(tokens[2], "POP") == 0) {
+                *word |= POP_MASK;
+            } else if (line->numTokens > 2 && strcasecmp(tokens[2], "PUSH") != 0) {
+                asmError(fileName, line, "PUP takes PUSH or POP, found '%s'", tokens[2]);
+                return -1;
+            }
+            return 0;
+        default: //RTI
+            return 0;
+    }
+}
+
+//Assembles an LC-3 source file straight into memory in two passes: the first tokenizes every
+//line, defines labels and assigns addresses, the second encodes. memory[0] holds the first
+//.ORIG address, which is returned through start_address. Returns 0, or -1 after printing an error.
+int assembleFile(const char *fileName, unsigned short *start_address) {
+    FILE *fp = fopen(fileName, "rb");
+    char *source, *text, *next;
+    Asm_Line *lines;
+    long size;
+    int numLines = 0, i, j, value, status = -1, hasOrigin = 0;
+    Register address = 0, origin = 0, word;
+    
+    if (fp == NULL) {
+        printf("Error: File not found.\n");
+        return -1;
+    }
+    fseek(fp, 0, SEEK_END);
+    size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    source = malloc(size + 1);
+    size = fread(source, 1, size, fp);
+    source[size] = '\0';
+    fclose(fp);
+    for (i = 0; i < size; i++) {
+        if (source[i] == '\n')
+            numLines++;
+    }
+    lines = malloc((numLines + 1) * sizeof(Asm_Line));
+    clearSymbols();
+    
+    //First pass: tokenize, define labels, assign addresses.
+    numLines = 0;
+    for (text = source; text != NULL; text = next) {
+        Asm_Line *line = &lines[numLines];
+        next = strchr(text, '\n');
+        if (next != NULL)
+            *next++ = '\0';
+        line->number = numLines + 1;
+        if (tokenizeLine(text, line) < 0) {
+            asmError(fileName, line, "too many operands or unterminated string");
+            goto done;
+        }
+        numLines++;
+        if (line->numTokens == 0)
+            continue;
+        if (mnemonicOpcode(line->tokens[0]) < 0) { //Label
+            char *label = line->tokens[0];
+            if (label[strlen(label) - 1] == ':')
+                label[strlen(label) - 1] = '\0';
+            if (!hasOrigin) {
+                asmError(fileName, line, "label before .ORIG");
+                goto done;
+            }
+            if (addSymbol(label, address) < 0) {
+                asmError(fileName, line, "label '%s' defined twice", label);
+                goto done;
+            }
+            for (j = 1; j < line->numTokens; j++)
+                line->tokens[j - 1] = line->tokens[j];
+            line->numTokens--;
+            if (line->numTokens == 0)
+                continue;
+            if (mnemonicOpcode(line->tokens[0]) < 0) {
+                asmError(fileName, line, "unknown instruction '%s'", line->tokens[0]);
+                goto done;
+            }
+        }
+        line->address = address;
+        if (strcasecmp(line->tokens[0], ".ORIG") == 0) {
+            if (line->numTokens < 2 || !parseNumber(line->tokens[1], &value)) {
+                asmError(fileName, line, ".ORIG needs an address");
+                goto done;
+            }
+            address = value;
+            if (!hasOrigin)
+                origin = address;
+            hasOrigin = 1;
+            continue;
+        }
+        if (strcasecmp(line->tokens[0], ".END") == 0)
+            break;
+        if (!hasOrigin) {
+            asmError(fileName, line, "code before .ORIG");
+            goto done;
+        }
+        if (strcasecmp(line->tokens[0], ".BLKW") == 0) {
+            if (line->numTokens < 2 || !parseNumber(line->tokens[1], &value) || value < 0) {
+                asmError(fileName, line, ".BLKW needs a word count");
+                goto done;
+            }
+            address += value;
+        } else if (strcasecmp(line->tokens[0], ".STRINGZ") == 0) {
+            if (line->string == NULL) {
+                asmError(fileName, line, ".STRINGZ needs a quoted string");
+                goto done;
+            }
+            address += line->stringLength + 1;
+        } else if (line->tokens[0][0] == '.' && strcasecmp(line->tokens[0], ".FILL") != 0) {
+            asmError(fileName, line, "unknown directive %s", line->tokens[0]);
+            goto done;
+        } else {
+            address++;
+        }
+    }
+    
+    //Second pass: encode into memory.
+    for (i = 0; i < numLines; i++) {
+        Asm_Line *line = &lines[i];
+        int count = 1;
+        if (line->numTokens == 0 || strcasecmp(line->tokens[0], ".ORIG") == 0)
+            continue;
+        if (strcasecmp(line->tokens[0], ".END") == 0)
+            break;
+        if (strcasecmp(line->tokens[0], ".BLKW") == 0)
+            parseNumber(line->tokens[1], &count);
+        else if (strcasecmp(line->tokens[0], ".STRINGZ") == 0)
+            count = line->stringLength + 1;
+        if ((Register) (line->address - origin) + count > SIZE_OF_MEM) {
+            asmError(fileName, line, "x%04X is outside the %d words of memory after x%04X", line->address, SIZE_OF_MEM, origin);
+            goto done;
+        }
+        
+        if (strcasecmp(line->tokens[0], ".FILL") == 0) {
+            Symbol *symbol = line->numTokens > 1 ? findSymbol(line->tokens[1]) : NULL;
+            if (symbol != NULL) {
+                value = symbol->address;
+            } else if (line->numTokens < 2 || !parseNumber(line->tokens[1], &value)) {
+                asmError(fileName, line, ".FILL needs a value or label");
+                goto done;
+            }
+            memory[line->address - origin] = value;
+        } else if (strcasecmp(line->tokens[0], ".BLKW") == 0) {
+            memset(&memory[line->address - origin], 0, count * sizeof(Register));
+        } else if (strcasecmp(line->tokens[0], ".STRINGZ") == 0) {
+            for (j = 0; j < count; j++)
+                memory[line->address - origin + j] = (unsigned char) line->string[j];
+        } else {
+            if (encodeInstruction(fileName, line, &word) < 0)
+                goto done;
+            memory[line->address - origin] = word;
+        }
+    }
+    *start_address = origin;
+    status = 0;
+    
+done:
+    free(lines);
+    free(source);
+    return status;
+}
+
+//Loads a program in the .hex format: the first line is the start address, every line after it
+//one word of memory.
+int loadHexFile(const char *fileName, unsigned short *start_address) {
+    char buf[5];
+    char *temp;
+    FILE *fp = fopen(fileName, "r");
+    if(fp == NULL){
+      printf("Error: File not found.\n");
+      return -1;
+    }
+    clearSymbols();
+    int i = 0;
+    while(!feof(fp)) {
+      if(i == 0){
+        fgets(buf, 5, fp);
+        *start_address = strtol(buf, &temp, STRTOL_BASE);
+        fgets(buf,3, fp);
+      }
+      fgets(buf, 5, fp);
+      if(i >= SIZE_OF_MEM){
+        printf("Error: Not enough memory");
+        break;
+      }
+      memory[i] = strtol(buf, &temp, STRTOL_BASE);
+      i++;
+      fgets(buf,3, fp);
+    }
+    fclose(fp);
+    return 0;
+}
+
+//Loads a program into memory, assembling it first if it is an .asm source.
+int loadProgram(const char *fileName, unsigned short *start_address) {
+    size_t length = strlen(fileName);
+    if (length > 4 && strcasecmp(fileName + length - 4, ".asm") == 0)
+        return assembleFile(fileName, start_address);
+    return loadHexFile(fileName, start_address);
+}
+
+//Returns 1 if the file changed since the last call (or since it was first seen).
+int fileChanged(const char *fileName, time_t *lastModified, off_t *lastSize) {
+    struct stat info;
+    if (stat(fileName, &info) < 0)
+        return 0;
+    if (info.st_mtime == *lastModified && info.st_size == *lastSize)
+        return 0;
+    *lastModified = info.st_mtime;
+    *lastSize = info.st_size;
+    return 1;
+}
+
+//Waits for menu input while watching the loaded source file. Returns 1 when input is ready, or
+//0 if the file changed first. Only a terminal is waited on, piped input is read as it comes.
+int waitForMenuInput(const char *fileName, time_t *lastModified, off_t *lastSize) {
+    fd_set readSet;
+    struct timeval timeout;
+    if (fileName[0] == '\0')
+        return 1;
+    if (!isatty(0))
+        return !fileChanged(fileName, lastModified, lastSize);
+    while (1) {
+        FD_ZERO(&readSet);
+        FD_SET(0, &readSet);
+        timeout.tv_sec = 0;
+        timeout.tv_usec = WATCH_INTERVAL_MS * 1000;
+        if (select(1, &readSet, NULL, NULL, &timeout) > 0)
+            return 1;
+        if (fileChanged(fileName, lastModified, lastSize))
+            return 0;
+    }
+}
+
+//Returns 1 and the cached word if address hits in the core's instruction cache. Never touches memory.
+int peekInstruction(CPU_p cpu, Register address, Register *word) {
+    Cache_Entry *line = &cpu->instructionCache[address % SIZE_OF_CACHE];
+    if (address >= SIZE_OF_MEM || !(line->entryInfo & VALID_BIT_MASK) || (line->entryInfo & TAG_MASK) != address / SIZE_OF_CACHE)
+        return 0;
+    *word = line->data;
+    return 1;
+}
+
+//Returns 1 and the cached word if address hits in the core's data cache. Never touches memory.
+int peekData(CPU_p cpu, Register address, Register *word) {
+    Cache_Entry *line = &cpu->dataCache[address % SIZE_OF_CACHE];
+    if (address >= SIZE_OF_MEM || isPerfRegister(address + cpu->origin) || !(line->entryInfo & VALID_BIT_MASK)
+        || (line->entryInfo & TAG_MASK) != address / SIZE_OF_CACHE)
+        return 0;
+    *word = line->data;
+    return 1;
+}
+
+//Returns 1 if the word is a BR whose target is the instruction just before it.
+int isLoopBackBranch(Register word) {
+    return (word >> OPCODE_SHIFT_AMT) == BR && (word & PCOFFSET9_MASK) == LOOP_BACK_OFFSET;
+}
+
+//Recognizes the delay loop "ADD Rd, Rd, #imm5; BR back" with the core at the ADD and both
+//instructions in its instruction cache. The remaining iterations are computed in one step and
+//the core is left exactly where executing them would have left it: after the final BR, with
+//the registers, ALU, CC and performance counters updated. Returns FAST_FORWARDED, IDLE_LOOP if
+//the branch is taken forever, or 0 if the loop does not match.
+int fastForwardCountdown(CPU_p cpu, ALU_p alu, Register breakpoints[]) {
+    Register head = cpu->PC, add, br, Rd, nzp, immed5, value, previous;
+    unsigned long iterations = 0;
+    if (!peekInstruction(cpu, head, &add) || !peekInstruction(cpu, head + 1, &br))
+        return 0;
+    if ((add >> OPCODE_SHIFT_AMT) != ADD || !(add & BIT_5_MASK) || !isLoopBackBranch(br))
+        return 0;
+    Rd = (add & DEST_REG_MASK) >> DEST_REG_SHIFT_AMT;
+    if (Rd != (add & SOURCE1_REG_MASK) >> SOURCE1_SHIFT_AMT)
+        return 0;
+    if (hitBreakpoint(breakpoints, head, NULL, 0) || hitBreakpoint(breakpoints, head + 1, NULL, 0))
+        return 0; //Stepping would stop inside the loop.
+    nzp = (br & DEST_REG_MASK) >> DEST_REG_SHIFT_AMT;
+    immed5 = add & IMMED5_MASK;
+    if (immed5 & BIT_4_MASK)
+        immed5 |= INVERSE_IMMED5_MASK;
+    
+    value = cpu->regFile[Rd];
+    do {
+        previous = value;
+        value += immed5;
+        iterations++;
+    } while ((conditionCode(value) & nzp) && iterations <= MAX_LOOP_ITERATIONS);
+    if (iterations > MAX_LOOP_ITERATIONS)
+        return IDLE_LOOP;
+    
+    cpu->regFile[Rd] = value;
+    setCC(value, cpu);
+    alu->A = previous;
+    alu->B = immed5;
+    alu->R = value;
+    cpu->MAR = head + 1; //FETCH of the final BR.
+    cpu->MDR = br;
+    cpu->IR = br;
+    cpu->PC = head + 2;
+    PERF_COUNT(cpu, cycles, iterations * 2 * CYCLES_PER_INSTRUCTION);
+    PERF_COUNT(cpu, instructionsRetired, iterations * 2);
+    return FAST_FORWARDED;
+}
+
+//Returns 1 if the core is spinning in "LD Rd, label; BR back" on a word it holds in its data
+//cache, and the branch will be taken. Unless another core writes that word the loop never exits.
+int isPollingCachedWord(CPU_p cpu, Register breakpoints[]) {
+    Register head = cpu->PC, word, ld, br, pcOffset, value, nzp;
+    if (!peekInstruction(cpu, head, &word))
+        return 0;
+    if (isLoopBackBranch(word)) //Between the LD and the BR.
+        head--;
+    if (!peekInstruction(cpu, head, &ld) || !peekInstruction(cpu, head + 1, &br))
+        return 0;
+    if ((ld >> OPCODE_SHIFT_AMT) != LD || !isLoopBackBranch(br))
+        return 0;
+    if (hitBreakpoint(breakpoints, head, NULL, 0) || hitBreakpoint(breakpoints, head + 1, NULL, 0))
+        return 0;
+    pcOffset = ld & PCOFFSET9_MASK;
+    if (pcOffset & BIT_8_MASK)
+        pcOffset |= INVERSE_PCOFFSET9_MASK;
+    if (!peekData(cpu, head + 1 + pcOffset, &value))
+        return 0;
+    nzp = (br & DEST_REG_MASK) >> DEST_REG_SHIFT_AMT;
+    if (cpu->PC != head && !(cpu->CC & nzp)) //About to fall out of the loop.
+        return 0;
+    return (conditionCode(value) & nzp) != 0;
+}
+
+//Returns 1 if every live core is polling a word that only another live core could change.
+//Nothing external writes memory, so the system would spin forever.
+int systemIdle(Register breakpoints[]) {
+    int c;
+    for (c = 0; c < numCores; c++) {
+        if (!cores[c].halted && !isPollingCachedWord(&cores[c].cpu, breakpoints))
+            return 0;
+    }
+    return 1;
+}
+
+//Executes one instruction on a core that is still running, and marks it halted when it
+//executes HALT or runs off the end of memory.
+int stepCore(Core_p core, unsigned short start_address) {
+    int response = completeOneInstructionCycle(&core->cpu, &core->alu, start_address);
+    memoryStall(&core->cpu);
+    if (response == HALT) {
+        core->halted = HALT;
+    } else if (core->cpu.PC == SIZE_OF_MEM) {
+        core->halted = END_OF_MEMORY;
+    }
+    return response;
+}
+
+//Returns the number of cores that have not halted yet.
+int liveCores() {
+    int c, live = 0;
+    for (c = 0; c < numCores; c++) {
+        if (!cores[c].halted)
+            live++;
+    }
+    return live;
+}
+
+//Pulls the fields out of an instruction word the same way DECODE does.
+void decodeInstruction(Register word, Register address, Decoded_Instruction *d) {
+    d->word = word;
+    d->address = address;
+    d->opcode = (word & OPCODE_MASK) >> OPCODE_SHIFT_AMT;
+    d->Rd = (word & DEST_REG_MASK) >> DEST_REG_SHIFT_AMT;
+    d->Rs1 = (word & SOURCE1_REG_MASK) >> SOURCE1_SHIFT_AMT;
+    d->Rs2 = word & SOURCE2_REG_MASK;
+    d->immediate = (word & BIT_5_MASK) != 0;
+    d->offset = 0;
+    switch (d->opcode) {
+        case LEA: //pcOffset9
+        case LD:
+        case ST:
+        case BR:
+        case LDI:
+        case STI:
+            d->offset = word & PCOFFSET9_MASK;
+            if (d->offset & BIT_8_MASK)
+                d->offset |= INVERSE_PCOFFSET9_MASK;
+            break;
+        case STR: //pcOffset6
+        case LDR:
+            d->offset = word & PCOFFSET6_MASK;
+            if (d->offset & BIT_5_MASK)
+                d->offset |= INVERSE_PCOFFSET6_MASK;
+            break;
+        case JSR: //pcOffset11
+            if (word & BIT_11_MASK) {
+                d->offset = word & PCOFFSET11_MASK;
+                if (d->offset & BIT_10_MASK)
+                    d->offset |= INVERSE_PCOFFSET11_MASK;
+            }
+            break;
+        case ADD: //immed5
+        case AND:
+            d->offset = word & IMMED5_MASK;
+            if (d->offset & BIT_4_MASK)
+                d->offset |= INVERSE_IMMED5_MASK;
+            break;
+        default:
+            break;
+    }
+}
+
+//Leaves the FETCH side effects of an instruction that hit in the instruction cache, and charges its cycles.
+void fetchDecoded(CPU_p cpu, Decoded_Instruction *d) {
+    cpu->MAR = d->address;
+    cpu->MDR = d->word;
+    cpu->IR = d->word;
+    cpu->PC = d->address + 1;
+    PERF_COUNT(cpu, cycles, CYCLES_PER_INSTRUCTION);
+}
+
+//Executes one decoded instruction with the same effect as completeOneInstructionCycle, including
+//the LDR/STR branch on BEN. Returns SIDE_EXIT without changing anything if the instruction has to
+//go through the reference engine instead.
+int executeDecoded(CPU_p cpu, ALU_p alu, Decoded_Instruction *d) {
+    Register BEN = cpu->CC & d->Rd;
+    Register address = cpu->regFile[d->Rs1] + d->offset;
+    if ((d->opcode == LDR || d->opcode == STR) && isPerfRegister(address + cpu->origin))
+        return SIDE_EXIT; //Counter reads must see the exact microstate timing.
+    
+    fetchDecoded(cpu, d);
+    switch (d->opcode) {
+        case ADD:
+        case AND:
+            alu->A = cpu->regFile[d->Rs1];
+            alu->B = d->immediate ? d->offset : cpu->regFile[d->Rs2];
+            alu->R = d->opcode == ADD ? alu->A + alu->B : alu->A & alu->B;
+            setCC(alu->R, cpu);
+            cpu->regFile[d->Rd] = alu->R;
+            break;
+        case NOT:
+            alu->A = cpu->regFile[d->Rs1];
+            alu->R = ~(alu->A);
+            setCC(alu->R, cpu);
+            cpu->regFile[d->Rd] = alu->R;
+            break;
+        case LD:
+            cpu->MAR = cpu->PC + d->offset;
+            getData(cpu);
+            cpu->regFile[d->Rd] = cpu->MDR;
+            setCC(cpu->regFile[d->Rd], cpu);
+            break;
+        case ST:
+            cpu->MAR = cpu->PC + d->offset;
+            cpu->MDR = cpu->regFile[d->Rd];
+            writeData(cpu);
+            break;
+        case LDR:
+            cpu->MAR = address;
+            if (BEN)
+                cpu->PC += d->offset;
+            getData(cpu);
+            cpu->regFile[d->Rd] = cpu->MDR;
+            setCC(cpu->regFile[d->Rd], cpu);
+            break;
+        case STR:
+            cpu->MAR = address;
+            if (BEN)
+                cpu->PC += d->offset;
+            cpu->MDR = cpu->regFile[d->Rd];
+            writeData(cpu);
+            break;
+        case BR:
+            if (BEN)
+                cpu->PC += d->offset;
+            break;
+        case JMP:
+            cpu->PC = cpu->regFile[d->Rs1];
+            break;
+        case JSR:
+            cpu->R7 = cpu->PC;
+            if (d->word & BIT_11_MASK)
+                cpu->PC += d->offset;
+            else
+                cpu->PC = cpu->regFile[d->Rs1];
+            break;
+        case LEA:
+            cpu->regFile[d->Rd] = cpu->PC + d->offset;
+            setCC(cpu->regFile[d->Rd], cpu);
+            break;
+        case PUP:
+            pushOrPop(cpu, d->Rd, d->word & POP_MASK, cpu->origin);
+            break;
+        default:
+            break;
+    }
+    PERF_COUNT(cpu, instructionsRetired, 1);
+    return 0;
+}
+
+//Executes a fused idiom as one operation. Only the final architectural state and the cache
+//accesses are produced, intermediate FETCH side effects are overwritten anyway.
+int executeFused(CPU_p cpu, ALU_p alu, Micro_Op *op) {
+    Decoded_Instruction *p = op->parts;
+    Decoded_Instruction *last = &op->parts[op->length - 1];
+    Register BEN, address;
+    int i;
+    switch (op->kind) {
+        case OP_LOAD_ADD_BRANCH:
+            cpu->MAR = p[0].address + 1 + p[0].offset;
+            getData(cpu);
+            cpu->regFile[p[0].Rd] = cpu->MDR; //The LD's CC is overwritten by the ADD.
+            alu->A = cpu->regFile[p[1].Rs1];
+            alu->B = p[1].immediate ? p[1].offset : cpu->regFile[p[1].Rs2];
+            alu->R = alu->A + alu->B;
+            cpu->regFile[p[1].Rd] = alu->R;
+            break;
+        case OP_ALU_BRANCH:
+            alu->A = cpu->regFile[p[0].Rs1];
+            alu->B = p[0].immediate ? p[0].offset : cpu->regFile[p[0].Rs2];
+            alu->R = p[0].opcode == ADD ? alu->A + alu->B : alu->A & alu->B;
+            cpu->regFile[p[0].Rd] = alu->R;
+            break;
+        case OP_NEGATE:
+            cpu->regFile[p[0].Rd] = ~cpu->regFile[p[0].Rs1];
+            alu->A = cpu->regFile[p[0].Rd];
+            alu->B = 1;
+            alu->R = alu->A + 1;
+            cpu->regFile[p[1].Rd] = alu->R;
+            break;
+        case OP_PUSH:
+            address = cpu->R6 - 1;
+            if (isPerfRegister(address + cpu->origin))
+                return SIDE_EXIT;
+            alu->A = cpu->R6;
+            alu->B = p[0].offset;
+            alu->R = address;
+            cpu->R6 = address;
+            setCC(alu->R, cpu);
+            cpu->MAR = address; //STR offset is 0, so its BEN branch cannot move the PC.
+            cpu->MDR = cpu->regFile[p[1].Rd];
+            writeData(cpu);
+            cpu->IR = last->word;
+            cpu->PC = last->address + 1;
+            PERF_COUNT(cpu, cycles, op->length * CYCLES_PER_INSTRUCTION);
+            PERF_COUNT(cpu, instructionsRetired, op->length);
+            return 0;
+        case OP_POP:
+            if (isPerfRegister(cpu->R6 + cpu->origin))
+                return SIDE_EXIT;
+            cpu->MAR = cpu->R6;
+            getData(cpu);
+            cpu->regFile[p[0].Rd] = cpu->MDR; //The LDR's CC is overwritten by the ADD.
+            alu->A = cpu->R6;
+            alu->B = p[1].offset;
+            alu->R = alu->A + alu->B;
+            cpu->R6 = alu->R;
+            break;
+        case OP_PUP_RUN:
+            for (i = 0; i < op->length; i++) {
+                pushOrPop(cpu, p[i].Rd, p[i].word & POP_MASK, cpu->origin);
+            }
+            fetchDecoded(cpu, last);
+            PERF_COUNT(cpu, cycles, (op->length - 1) * CYCLES_PER_INSTRUCTION);
+            PERF_COUNT(cpu, instructionsRetired, op->length);
+            return 0;
+    }
+    
+    //Every other idiom ends with an ALU result that sets CC, optionally followed by a BR.
+    setCC(alu->R, cpu);
+    BEN = cpu->CC & last->Rd;
+    fetchDecoded(cpu, last);
+    if (last->opcode == BR && BEN)
+        cpu->PC += last->offset;
+    PERF_COUNT(cpu, cycles, (op->length - 1) * CYCLES_PER_INSTRUCTION);
+    PERF_COUNT(cpu, instructionsRetired, op->length);
+    return 0;
+}
+
+//Returns 1 if every instruction of the op still hits in the instruction cache with the word it
+//was decoded from. Anything evicted or overwritten since the superblock was formed fails here.
+int opResident(CPU_p cpu, Micro_Op *op) {
+    Register word;
+    int i;
+    for (i = 0; i < op->length; i++) {
+        if (!peekInstruction(cpu, op->parts[i].address, &word) || word != op->parts[i].word)
+            return 0;
+    }
+    return 1;
+}
+
+//Returns 1 if a breakpoint sits between the instructions of a fused op, where it could not stop.
+int breakpointInsideOp(Micro_Op *op, Register breakpoints[]) {
+    int i;
+    for (i = 1; i < op->length; i++) {
+        if (hitBreakpoint(breakpoints, op->parts[i].address, NULL, 0))
+            return 1;
+    }
+    return 0;
+}
+
+//Returns the fused idiom starting at parts[0], or OP_SINGLE. parts holds up to
+//MAX_FUSED_INSTRUCTIONS decoded instructions that follow each other in memory.
+int matchIdiom(Decoded_Instruction parts[], int available, int *length) {
+    Decoded_Instruction *a = &parts[0], *b = &parts[1], *c = &parts[2];
+    int i;
+    *length = 1;
+    if (available >= 3 && a->opcode == LD && b->opcode == ADD && c->opcode == BR) {
+        *length = 3;
+        return OP_LOAD_ADD_BRANCH;
+    }
+    if (available >= 2 && a->opcode == ADD && a->Rd == 6 && a->Rs1 == 6 && a->immediate && a->offset == NEG_NUM_MASK
+        && b->opcode == STR && b->Rs1 == 6 && b->offset == 0) {
+        *length = 2;
+        return OP_PUSH;
+    }
+    if (available >= 2 && a->opcode == LDR && a->Rs1 == 6 && a->Rd != 6 && a->offset == 0
+        && b->opcode == ADD && b->Rd == 6 && b->Rs1 == 6 && b->immediate && b->offset == 1) {
+        *length = 2;
+        return OP_POP;
+    }
+    if (available >= 2 && a->opcode == NOT && b->opcode == ADD && b->Rd == a->Rd && b->Rs1 == a->Rd
+        && b->immediate && b->offset == 1) {
+        *length = 2;
+        return OP_NEGATE;
+    }
+    if (available >= 2 && (a->opcode == ADD || a->opcode == AND) && b->opcode == BR) {
+        *length = 2;
+        return OP_ALU_BRANCH;
+    }
+    if (available >= 2 && a->opcode == PUP) {
+        for (i = 1; i < available && parts[i].opcode == PUP && (parts[i].word & POP_MASK) == (a->word & POP_MASK); i++);
+        if (i > 1) {
+            *length = i;
+            return OP_PUP_RUN;
+        }
+    }
+    return OP_SINGLE;
+}
+
+//Returns 1 if the instruction can be part of a superblock. TRAPs do I/O, and LDI/STI and loads of
+//the counter registers depend on microstate timing, so those stay in the reference engine.
+int traceable(CPU_p cpu, Decoded_Instruction *d) {
+    switch (d->opcode) {
+        case TRAP:
+        case LDI:
+        case STI:
+        case 8: //RTI, unused
+            return 0;
+        case LD:
+        case ST:
+            return !isPerfRegister(d->address + 1 + d->offset + cpu->origin);
+        default:
+            return 1;
+    }
+}
+
+//Forms a superblock from head by following the hot path through the instruction cache: conditional
+//branches fall through (taken is a side exit), unconditional branches and JSR are followed, and a
+//RET back into the trace continues after its call. The trace ends at an instruction it cannot
+//handle, an indirect jump, when it gets back to an address it already covers, or when full.
+void formSuperblock(Core_p core, Register head) {
+    CPU_p cpu = &core->cpu;
+    Superblock *sb = &core->superblocks[head % NUM_SUPERBLOCKS];
+    Decoded_Instruction parts[MAX_FUSED_INSTRUCTIONS];
+    Register returnStack[MAX_TRACE_CALL_DEPTH];
+    Register pc = head, word, next;
+    int depth = 0, available, length, i, j, done = 0;
+    
+    sb->valid = 0;
+    sb->head = head;
+    sb->lowAddress = head;
+    sb->highAddress = head;
+    sb->numOps = 0;
+    while (!done && sb->numOps < MAX_SUPERBLOCK_OPS) {
+        for (available = 0; available < MAX_FUSED_INSTRUCTIONS && pc + available < SIZE_OF_MEM; available++) {
+            if (!peekInstruction(cpu, pc + available, &word))
+                break;
+            decodeInstruction(word, pc + available, &parts[available]);
+            if (!traceable(cpu, &parts[available]))
+                break;
+        }
+        if (available == 0)
+            break;
+        
+        Micro_Op *op = &sb->ops[sb->numOps++];
+        op->kind = matchIdiom(parts, available, &length);
+        op->length = length;
+        memcpy(op->parts, parts, length * sizeof(Decoded_Instruction));
+        Decoded_Instruction *last = &parts[length - 1];
+        if (last->address > sb->highAddress)
+            sb->highAddress = last->address;
+        if (pc < sb->lowAddress)
+            sb->lowAddress = pc;
+        
+        next = last->address + 1;
+        if (last->opcode == BR && (last->Rd & NZP_MASK) == NZP_MASK) { //BRnzp, CC always has one bit set.
+            next += last->offset;
+        } else if (last->opcode == JSR && (last->word & BIT_11_MASK)) {
+            if (depth == MAX_TRACE_CALL_DEPTH)
+                done = 1;
+            else
+                returnStack[depth++] = next;
+            next += last->offset;
+        } else if (last->opcode == JMP || last->opcode == JSR) {
+            if (last->opcode == JMP && last->Rs1 == 7 && depth > 0)
+                next = returnStack[--depth]; //RET, guarded at run time by comparing the PC.
+            else
+                done = 1;
+        }
+        
+        if (next == head || next >= SIZE_OF_MEM)
+            done = 1;
+        for (i = 0; i < sb->numOps && !done; i++) { //Do not unroll inner loops.
+            for (j = 0; j < sb->ops[i].length; j++) {
+                if (sb->ops[i].parts[j].address == next)
+                    done = 1;
+            }
+        }
+        pc = next;
+    }
+    sb->valid = sb->numOps > 0;
+}
+
+//Runs a superblock until control leaves it. After every op the PC is compared with the address
+//of the next op, so branches taken off the trace, LDR/STR BEN branches and RETs to another caller
+//all end the run with the state exactly as the reference engine would leave it. Returns
+//BREAKPOINT_REACHED if the PC lands on a breakpoint (which is removed, like RUN does), SIDE_EXIT
+//if not even the first op could run, or 0.
+int runSuperblock(Core_p core, Superblock *sb, Register breakpoints[], int *numBreakpoints) {
+    CPU_p cpu = &core->cpu;
+    int i = 0, status;
+    int shared = executionMode == THREADED && numCores > 1; //Another core could invalidate the instructions under us.
+    while (i < sb->numOps) {
+        Micro_Op *op = &sb->ops[i];
+        if (shared)
+            pthread_mutex_lock(&busLock);
+        if (!sb->valid || !opResident(cpu, op) || (*numBreakpoints > 0 && breakpointInsideOp(op, breakpoints))) {
+            if (shared)
+                pthread_mutex_unlock(&busLock);
+            return i == 0 ? SIDE_EXIT : 0;
+        }
+        if (op->kind == OP_SINGLE)
+            status = executeDecoded(cpu, &core->alu, &op->parts[0]);
+        else
+            status = executeFused(cpu, &core->alu, op);
+        if (status != SIDE_EXIT && *numBreakpoints > 0 && hitBreakpoint(breakpoints, cpu->PC, numBreakpoints, 1))
+            status = BREAKPOINT_REACHED;
+        if (shared)
+            pthread_mutex_unlock(&busLock);
+        memoryStall(cpu);
+        if (status != 0)
+            return status == SIDE_EXIT && i > 0 ? 0 : status;
+        i++;
+        if (cpu->PC == SIZE_OF_MEM || i == sb->numOps || cpu->PC != sb->ops[i].parts[0].address)
+            return 0;
+    }
+    return 0;
+}
+
+//Executes the next instruction(s) of a core for RUN: through the superblock headed by the PC
+//when there is one, otherwise through the reference engine, counting entries into block heads
+//to find hot paths. Returns BREAKPOINT_REACHED if a superblock stopped on a breakpoint.
+int stepCoreFast(Core_p core, Register breakpoints[], int *numBreakpoints, unsigned short start_address) {
+    Register pc = core->cpu.PC;
+    Superblock *sb = &core->superblocks[pc % NUM_SUPERBLOCKS];
+    int status;
+    if (sb->valid && sb->head == pc) {
+        status = runSuperblock(core, sb, breakpoints, numBreakpoints);
+        if (status != SIDE_EXIT) {
+            if (core->cpu.PC == SIZE_OF_MEM)
+                core->halted = END_OF_MEMORY;
+            core->fallThroughPC = SIZE_OF_MEM; //Wherever the trace was left is a block head.
+            return status;
+        }
+    } else if (pc < SIZE_OF_MEM && pc != core->fallThroughPC && ++core->executionCount[pc] >= SUPERBLOCK_THRESHOLD) {
+        core->executionCount[pc] = 0;
+        pthread_mutex_lock(&busLock);
+        formSuperblock(core, pc);
+        pthread_mutex_unlock(&busLock);
+    }
+    stepCore(core, start_address);
+    core->fallThroughPC = pc + 1;
+    return 0;
+}
+
+//Advances a core for RUN. With fast set a delay loop is fast-forwarded, or the next instructions
+//run through stepCoreFast; otherwise the reference engine executes one instruction. Returns
+//IDLE_LOOP if the core would spin forever, BREAKPOINT_REACHED, or 0.
+int runStep(Core_p core, int fast, Register breakpoints[], int *numBreakpoints, unsigned short start_address) {
+    int skipped = fast ? fastForwardCountdown(&core->cpu, &core->alu, breakpoints) : 0;
+    if (skipped == IDLE_LOOP) {
+        return IDLE_LOOP;
+    } else if (skipped == FAST_FORWARDED) {
+        if (core->cpu.PC == SIZE_OF_MEM)
+            core->halted = END_OF_MEMORY;
+        return 0;
+    } else if (fast) {
+        return stepCoreFast(core, breakpoints, numBreakpoints, start_address);
+    }
+    stepCore(core, start_address);
+    return 0;
+}
+
+//Interleaves the cores one instruction at a time, in core order, until every core has halted
+//or one of them reaches a breakpoint. Deterministic for a given program.
+//Delay loops are fast-forwarded and superblocks used only when a single core is left, so the
+//interleaving is unchanged. Like them, the idle check is off with -r or tracing, so every
+//instruction is stepped.
+int runRoundRobin(Register breakpoints[], int *numBreakpoints, unsigned short start_address, int *stoppedCore) {
+    int c, status;
+    while (liveCores() > 0) {
+        if (interruptRequested) {
+            for (c = 0; cores[c].halted; c++);
+            *stoppedCore = c;
+            return INTERRUPTED;
+        }
+        if (!useReferenceEngine() && systemIdle(breakpoints)) {
+            for (c = 0; cores[c].halted; c++);
+            *stoppedCore = c;
+            return IDLE_LOOP;
+        }
+        for (c = 0; c < numCores; c++) {
+            if (cores[c].halted)
+                continue;
+            status = runStep(&cores[c], liveCores() == 1 && !useReferenceEngine(), breakpoints, numBreakpoints, start_address);
+            if (status == IDLE_LOOP || status == BREAKPOINT_REACHED) {
+                *stoppedCore = c;
+                return status;
+            }
+            if (!cores[c].halted && hitBreakpoint(breakpoints, cores[c].cpu.PC, numBreakpoints, 1)) {
+                *stoppedCore = c;
+                return BREAKPOINT_REACHED;
+            }
+        }
+    }
+    return 0;
+}
+
+typedef struct Run_Context {
+    Core_p core;
+    Register *breakpoints;
+    int *numBreakpoints;
+    unsigned short start_address;
+    int *stoppedCore; //Shared by all threads, -1 until some core stops the run.
+    int *stopReason;  //BREAKPOINT_REACHED or IDLE_LOOP, written together with stoppedCore.
+}
+Run_Context;
+
+//Host thread body for THREADED mode, runs one core until it halts or any core hits a breakpoint.
+void *runCoreThread(void *arg) {
+    Run_Context *context = arg;
+    Core_p core = context->core;
+    int stop = 0, skipped, status = 0;
+    while (!core->halted && !stop) {
+        status = 0;
+        pthread_mutex_lock(&busLock); //Other cores may invalidate the loop under us.
+        skipped = useReferenceEngine() ? 0 : fastForwardCountdown(&core->cpu, &core->alu, context->breakpoints);
+        pthread_mutex_unlock(&busLock);
+        if (skipped == FAST_FORWARDED && core->cpu.PC == SIZE_OF_MEM)
+            core->halted = END_OF_MEMORY;
+        else if (skipped == 0 && useReferenceEngine())
+            stepCore(core, context->start_address);
+        else if (skipped == 0)
+            status = stepCoreFast(core, context->breakpoints, context->numBreakpoints, context->start_address);
+        pthread_mutex_lock(&busLock);
+        if (*context->stoppedCore >= 0) {
+            stop = 1;
+        } else if (status == BREAKPOINT_REACHED) {
+            *context->stoppedCore = core->cpu.coreId;
+            *context->stopReason = BREAKPOINT_REACHED;
+            stop = 1;
+        } else if (skipped == IDLE_LOOP) {
+            *context->stoppedCore = core->cpu.coreId;
+            *context->stopReason = IDLE_LOOP;
+            stop = 1;
+        } else if (!core->halted && hitBreakpoint(context->breakpoints, core->cpu.PC, context->numBreakpoints, 1)) {
+            *context->stoppedCore = core->cpu.coreId;
+            *context->stopReason = BREAKPOINT_REACHED;
+            stop = 1;
+        }
+        pthread_mutex_unlock(&busLock);
+    }
+    return NULL;
+}
+
+//Runs every live core on its own host thread. Interleaving is up to the host scheduler, so
+//superblocks and delay loop fast-forwarding are always on, polling loops spin until another
+//core writes.
+int runThreaded(Register breakpoints[], int *numBreakpoints, unsigned short start_address, int *stoppedCore) {
+    pthread_t threads[MAX_NUM_CORES];
+    Run_Context contexts[MAX_NUM_CORES];
+    int c, stopReason = 0;
+    *stoppedCore = -1;
+    for (c = 0; c < numCores; c++) {
+        contexts[c].core = &cores[c];
+        contexts[c].breakpoints = breakpoints;
+        contexts[c].numBreakpoints = numBreakpoints;
+        contexts[c].start_address = start_address;
+        contexts[c].stoppedCore = stoppedCore;
+        contexts[c].stopReason = &stopReason;
+        pthread_create(&threads[c], NULL, runCoreThread, &contexts[c]);
+    }
+    for (c = 0; c < numCores; c++) {
+        pthread_join(threads[c], NULL);
+    }
+    return stopReason;
+}
+
+//Prints one line per core so the state of the cores not shown in the monitor is visible.
+void printCoreSummary(int shownCore, unsigned short start_address) {
+    int c;
+    for (c = 0; c < numCores; c++) {
+        printf("%sCore %d: PC:x%04X %-8s", c == shownCore ? "*" : " ", c, cores[c].cpu.PC + start_address,
+               cores[c].halted ? "halted" : "running");
+        if (c % 4 == 3 || c == numCores - 1)
+            printf("\n");
+    }
+}
+
+//Prints each core's performance counters, the same values the guest reads at PERF_CYCLE_LO and up.
+void printPerfCounters() {
+    int c;
+    printf("\n======= Performance Counters =======\n");
+    for (c = 0; c < numCores; c++) {
+        Perf_Counters *perf = &cores[c].cpu.perf;
+        if (numCores > 1)
+            printf("Core %d: ", c);
+        printf("Cycles: %lu  Instructions: %lu  I-cache misses: %lu  D-cache misses: %lu\n",
+               perf->cycles, perf->instructionsRetired, perf->instructionCacheMisses, perf->dataCacheMisses);
+    }
+    printf("====================================\n");
+}
+
+//Prints the coherence traffic counted since the program was loaded.
+void printCoherenceStats() {
+    printf("\n======= Coherence Traffic (%d cores, %s) =======\n", numCores,
+           executionMode == THREADED ? "threaded" : "round-robin");
+    printf("BusRd: %lu  BusRdX: %lu  BusUpgr: %lu\n", coherenceStats.busReads,
+           coherenceStats.busReadXs, coherenceStats.busUpgrades);
+    printf("Invalidations: %lu  Interventions: %lu  Write backs: %lu  SWAPs: %lu\n",
+           coherenceStats.invalidations, coherenceStats.interventions,
+           coherenceStats.writeBacks, coherenceStats.atomics);
+    printf("=================================================\n");
+}
+
+//Reads a word for the debugger without disturbing the caches: a Modified copy in some core's
+//data cache is newer than memory, anything else is not.
+Register debugRead(Register address) {
+    int c;
+    for (c = 0; c < numCores; c++) {
+        Cache_Entry *line = &cores[c].dataCache[address % SIZE_OF_CACHE];
+        if ((line->entryInfo & MESI_STATE_MASK) == MODIFIED_STATE && (line->entryInfo & TAG_MASK) == address / SIZE_OF_CACHE)
+            return line->data;
+    }
+    return memory[address];
+}
+
+//Writes a word for the debugger. Memory and every cached copy get the new value, and anything
+//decoded from the old one is thrown away.
+void debugWrite(Register address, Register value) {
+    int c;
+    memory[address] = value;
+    for (c = 0; c < numCores; c++) {
+        Cache_Entry *line = &cores[c].dataCache[address % SIZE_OF_CACHE];
+        if ((line->entryInfo & VALID_BIT_MASK) && (line->entryInfo & TAG_MASK) == address / SIZE_OF_CACHE) {
+            line->data = value;
+            line->entryInfo &= ~DIRTY_BIT_MASK;
+        }
+    }
+    invalidateCode(address);
+}
+
+//Connection state of a debugger session.
+typedef struct Gdb_Session {
+    int fd;
+    int noAck;   //Set once the client asked for QStartNoAckMode.
+    int core;    //Core selected with Hg, the one registers are read from and s steps.
+    unsigned short start_address;
+    Register breakpoints[MAX_NUM_BKPTS];
+    int numBreakpoints;
+    char input[GDB_PACKET_SIZE];
+    int inputLength, inputPosition;
+    volatile int running; //Cleared by the run thread when the target stops.
+    int stopReason;
+    int stoppedCore;
+}
+Gdb_Session;
+
+//Returns the next byte from the connection, or -1 once it is closed.
+int gdbGetChar(Gdb_Session *session) {
+    if (session->inputPosition == session->inputLength) {
+        session->inputLength = read(session->fd, session->input, sizeof(session->input));
+        session->inputPosition = 0;
+        if (session->inputLength <= 0)
+            return -1;
+    }
+    return (unsigned char) session->input[session->inputPosition++];
+}
+
+int gdbHexDigit(int c) {
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+//Parses hex digits at *text and leaves *text after them.
+unsigned long gdbParseHex(const char **text) {
+    unsigned long value = 0;
+    while (gdbHexDigit(**text) >= 0) {
+        value = (value << 4) | gdbHexDigit(**text);
+        (*text)++;
+    }
+    return value;
+}
+
+//Appends a register or memory word in target byte order (little-endian).
+char *gdbPutWord(char *out, Register word) {
+    return out + sprintf(out, "%02x%02x", word & 0xFF, word >> 8);
+}
+
+//Reads two hex digits as a byte. Returns 0 and leaves *text alone if they are missing.
+Register gdbGetByte(const char **text) {
+    int high = gdbHexDigit((*text)[0]);
+    int low = high < 0 ? -1 : gdbHexDigit((*text)[1]);
+    if (low < 0)
+        return 0;
+    *text += 2;
+    return (high << 4) | low;
+}
+
+//Reads a little-endian word written by gdbPutWord.
+Register gdbGetWord(const char **text) {
+    Register low = gdbGetByte(text);
+    return low | (gdbGetByte(text) << 8);
+}
+
+//Receives one packet into packet, acknowledging it. Returns its length, or -1 once the
+//connection is closed. A lone ^C is returned as a one-character packet.
+int gdbReadPacket(Gdb_Session *session, char *packet) {
+    int c, length, checksum, high, low;
+    while (1) {
+        do {
+            c = gdbGetChar(session);
+            if (c == '\003') {
+                packet[0] = '\003';
+                packet[1] = '\0';
+                return 1;
+            }
+        } while (c != '$' && c != -1);
+        if (c == -1)
+            return -1;
+        length = checksum = 0;
+        while ((c = gdbGetChar(session)) != '#' && c != -1) {
+            if (length < GDB_PACKET_SIZE - 1)
+                packet[length++] = c;
+            checksum += c;
+        }
+        if (c == -1)
+            return -1;
+        packet[length] = '\0';
+        high = gdbHexDigit(gdbGetChar(session));
+        low = gdbHexDigit(gdbGetChar(session));
+        if (session->noAck)
+            return length;
+        if (high >= 0 && low >= 0 && (high << 4 | low) == (checksum & 0xFF)) {
+            write(session->fd, "+", 1);
+            return length;
+        }
+        write(session->fd, "-", 1); //Ask for a retransmission.
+    }
+}
+
+//Sends a reply packet and waits for the client to acknowledge it.
+void gdbSendPacket(Gdb_Session *session, const char *payload) {
+    static char frame[GDB_PACKET_SIZE + 4];
+    int i, length = strlen(payload), checksum = 0, c;
+    for (i = 0; i < length; i++) {
+        checksum += (unsigned char) payload[i];
+    }
+    frame[0] = '$';
+    memcpy(frame + 1, payload, length);
+    sprintf(frame + 1 + length, "#%02x", checksum & 0xFF);
+    do {
+        write(session->fd, frame, length + 4);
+        c = session->noAck ? '+' : gdbGetChar(session);
+    } while (c == '-');
+}
+
+//Register description so the client knows the layout of the g packet.
+const char *gdbTargetXml =
+    "<?xml version=\"1.0\"?><!DOCTYPE target SYSTEM \"gdb-target.dtd\">"
+    "<target><feature name=\"org.lc3.core\">"
+    "<reg name=\"r0\" bitsize=\"16\" type=\"int\"/><reg name=\"r1\" bitsize=\"16\" type=\"int\"/>"
+    "<reg name=\"r2\" bitsize=\"16\" type=\"int\"/><reg name=\"r3\" bitsize=\"16\" type=\"int\"/>"
+    "<reg name=\"r4\" bitsize=\"16\" type=\"int\"/><reg name=\"r5\" bitsize=\"16\" type=\"int\"/>"
+    "<reg name=\"r6\" bitsize=\"16\" type=\"data_ptr\"/><reg name=\"r7\" bitsize=\"16\" type=\"code_ptr\"/>"
+    "<reg name=\"pc\" bitsize=\"32\" type=\"code_ptr\"/><reg name=\"cc\" bitsize=\"16\" type=\"int\"/>"
+    "</feature></target>";
+
+//Returns a register of the selected core. The PC is a byte address like those of m, Z and the
+//watchpoint stops, so word x3000 is 2 * x3000.
+unsigned long gdbGetRegister(Gdb_Session *session, int number) {
+    CPU_p cpu = &cores[session->core].cpu;
+    if (number == GDB_PC_REGISTER)
+        return (unsigned long) (Register) (cpu->PC + session->start_address) * 2;
+    if (number == GDB_CC_REGISTER)
+        return cpu->CC;
+    return cpu->regFile[number];
+}
+
+void gdbSetRegister(Gdb_Session *session, int number, unsigned long value) {
+    CPU_p cpu = &cores[session->core].cpu;
+    if (number == GDB_PC_REGISTER) {
+        cpu->PC = (Register) (value / 2) - session->start_address;
+        cores[session->core].fallThroughPC = SIZE_OF_MEM; //Jumped, the next PC is a block head.
+    } else if (number == GDB_CC_REGISTER) {
+        cpu->CC = value & NZP_MASK;
+    } else {
+        cpu->regFile[number] = value;
+    }
+}
+
+//Appends a register in target byte order, four bytes for the PC and two for the others.
+char *gdbPutRegister(char *out, Gdb_Session *session, int number) {
+    unsigned long value = gdbGetRegister(session, number);
+    out = gdbPutWord(out, value);
+    return number == GDB_PC_REGISTER ? gdbPutWord(out, value >> 16) : out;
+}
+
+//Reads a register written by gdbPutRegister.
+unsigned long gdbGetRegisterValue(const char **text, int number) {
+    unsigned long value = gdbGetWord(text);
+    return number == GDB_PC_REGISTER ? value | (unsigned long) gdbGetWord(text) << 16 : value;
+}
+
+//Turns a client byte address into an offset into memory[]. Words are two bytes, so byte
+//address 2 * x3000 is word x3000. Returns -1 outside the loaded memory.
+int gdbMemoryOffset(Gdb_Session *session, unsigned long byteAddress) {
+    Register offset = (Register) (byteAddress / 2) - session->start_address;
+    return offset < SIZE_OF_MEM ? offset : -1;
+}
+
+//Interleaves the cores one reference-engine instruction at a time, stopping after the first
+//instruction that touches a watchpoint. Used for continue while watchpoints are set, as
+//superblocks and fast-forwarding would run past the access.
+int runWatched(Gdb_Session *session, Register breakpoints[], int *stoppedCore) {
+    int c;
+    while (liveCores() > 0) {
+        for (c = 0; c < numCores; c++) {
+            if (cores[c].halted)
+                continue;
+            if (interruptRequested) {
+                *stoppedCore = c;
+                return INTERRUPTED;
+            }
+            stepCore(&cores[c], session->start_address);
+            if (watchHitType) {
+                *stoppedCore = c;
+                return WATCHPOINT_REACHED;
+            }
+            if (!cores[c].halted && hitBreakpoint(breakpoints, cores[c].cpu.PC, NULL, 0)) {
+                *stoppedCore = c;
+                return BREAKPOINT_REACHED;
+            }
+        }
+    }
+    return 0;
+}
+
+//Host thread that runs the target for a continue packet, so the session can watch for ^C.
+void *gdbRunThread(void *arg) {
+    Gdb_Session *session = arg;
+    Register breakpoints[MAX_NUM_BKPTS];
+    int numBreakpoints = session->numBreakpoints;
+    memcpy(breakpoints, session->breakpoints, sizeof(breakpoints)); //RUN drops the one it stops at, keep ours.
+    if (numWatchpoints > 0)
+        session->stopReason = runWatched(session, breakpoints, &session->stoppedCore);
+    else
+        session->stopReason = runRoundRobin(breakpoints, &numBreakpoints, session->start_address, &session->stoppedCore);
+    session->running = 0;
+    return NULL;
+}
+
+//Continues every core until a breakpoint, watchpoint, ^C from the client, or the program halts.
+//Other bytes the client sends meanwhile stay in the session's input for the next packet.
+void gdbContinue(Gdb_Session *session) {
+    pthread_t thread;
+    fd_set readSet;
+    struct timeval timeout;
+    char *c, *end;
+    int length;
+    interruptRequested = 0;
+    session->running = 1;
+    pthread_create(&thread, NULL, gdbRunThread, session);
+    while (session->running) {
+        end = session->input + session->inputLength;
+        while ((c = memchr(session->input + session->inputPosition, '\003', end - session->input - session->inputPosition)) != NULL) {
+            memmove(c, c + 1, end - c - 1);
+            end--;
+            session->inputLength--;
+            interruptRequested = 1;
+        }
+        if (session->inputPosition > 0) { //Make room after what is still unread.
+            memmove(session->input, session->input + session->inputPosition, session->inputLength - session->inputPosition);
+            session->inputLength -= session->inputPosition;
+            session->inputPosition = 0;
+        }
+        FD_ZERO(&readSet);
+        if (session->inputLength < (int) sizeof(session->input))
+            FD_SET(session->fd, &readSet);
+        timeout.tv_sec = 0;
+        timeout.tv_usec = GDB_POLL_INTERVAL_MS * 1000;
+        if (select(session->fd + 1, &readSet, NULL, NULL, &timeout) > 0) {
+            length = read(session->fd, session->input + session->inputLength, sizeof(session->input) - session->inputLength);
+            if (length <= 0)
+                interruptRequested = 1; //Closed, the next packet read sees it.
+            else
+                session->inputLength += length;
+        }
+    }
+    pthread_join(thread, NULL);
+    interruptRequested = 0;
+}
+
+//Builds the stop reply for the last resume: W00 once every core has halted, otherwise a T packet
+//naming the signal, the watchpoint that fired if any, and the core as the thread.
+void gdbStopReply(Gdb_Session *session, char *reply) {
+    const char *kinds[] = {"", "", "watch", "rwatch", "awatch"};
+    if (liveCores() == 0) {
+        strcpy(reply, "W00");
+        return;
+    }
+    session->core = session->stoppedCore;
+    reply += sprintf(reply, "T%02x", session->stopReason == INTERRUPTED ? GDB_SIGINT : GDB_SIGTRAP);
+    if (session->stopReason == WATCHPOINT_REACHED)
+        reply += sprintf(reply, "%s:%lx;", kinds[watchHitType], (unsigned long) (watchHitAddress + session->start_address) * 2);
+    sprintf(reply, "thread:%x;", session->core + 1);
+    watchHitType = 0;
+}
+
+//Handles Z and z packets. Breakpoints share the MAX_NUM_BKPTS slots of the menu's Set Bkpt,
+//watchpoints cover length / 2 words.
+void gdbBreakpoint(Gdb_Session *session, const char *packet, char *reply) {
+    const char *p = packet + 1;
+    int insert = packet[0] == 'Z', i;
+    int type, offset;
+    unsigned long length;
+    type = gdbParseHex(&p);
+    p++;
+    offset = gdbMemoryOffset(session, gdbParseHex(&p));
+    p++;
+    length = gdbParseHex(&p);
+    if (offset < 0) {
+        strcpy(reply, "E01");
+        return;
+    }
+    if (type == 0 || type == 1) { //Software or hardware breakpoint, both are PC compares here.
+        if (!insert) {
+            hitBreakpoint(session->breakpoints, offset, &session->numBreakpoints, 1);
+        } else if (!hitBreakpoint(session->breakpoints, offset, NULL, 0)) {
+            if (session->numBreakpoints == MAX_NUM_BKPTS) {
+                strcpy(reply, "E02");
+                return;
+            }
+            session->breakpoints[getEmptyIndex(session->breakpoints)] = offset;
+            session->numBreakpoints++;
+        }
+    } else if (type >= WATCH_WRITE && type <= WATCH_ACCESS) {
+        Register words = length > 1 ? length / 2 : 1;
+        for (i = 0; i < numWatchpoints; i++) {
+            if (watchpoints[i].address == offset && watchpoints[i].length == words && watchpoints[i].type == type)
+                break;
+        }
+        if (!insert) {
+            if (i < numWatchpoints)
+                watchpoints[i] = watchpoints[--numWatchpoints];
+        } else if (i == numWatchpoints) {
+            if (numWatchpoints == MAX_NUM_WATCHPOINTS) {
+                strcpy(reply, "E02");
+                return;
+            }
+            watchpoints[numWatchpoints].address = offset;
+            watchpoints[numWatchpoints].length = words;
+            watchpoints[numWatchpoints].type = type;
+            numWatchpoints++;
+        }
+    } else {
+        reply[0] = '\0'; //Unsupported type.
+        return;
+    }
+    strcpy(reply, "OK");
+}
+
+//Handles m and M packets. Reads come from memory and dirty cache lines, the perf counter
+//registers read like the guest sees them.
+void gdbMemory(Gdb_Session *session, const char *packet, char *reply) {
+    const char *p = packet + 1;
+    unsigned long address, length, i;
+    int offset;
+    Register word;
+    address = gdbParseHex(&p);
+    p++;
+    length = gdbParseHex(&p);
+    if (packet[0] == 'm' && length > (GDB_PACKET_SIZE - 1) / 2)
+        length = (GDB_PACKET_SIZE - 1) / 2;
+    if (packet[0] == 'M')
+        p++; //Skip the ':'
+    for (i = 0; i < length; i++, address++) {
+        offset = gdbMemoryOffset(session, address);
+        if (offset < 0 && isPerfRegister(address / 2) && packet[0] == 'm') {
+            word = peekPerfRegister(&cores[session->core].cpu, address / 2);
+        } else if (offset < 0) {
+            strcpy(reply, "E01");
+            return;
+        } else {
+            word = debugRead(offset);
+        }
+        if (packet[0] == 'm') {
+            reply += sprintf(reply, "%02x", address & 1 ? word >> 8 : word & 0xFF);
+        } else {
+            Register byte = gdbGetByte(&p);
+            word = address & 1 ? (word & 0x00FF) | (byte << 8) : (word & 0xFF00) | byte;
+            debugWrite(offset, word);
+        }
+    }
+    if (packet[0] == 'M')
+        strcpy(reply, "OK");
+}
+
+//Answers the q queries the client sends while connecting.
+void gdbQuery(Gdb_Session *session, const char *packet, char *reply) {
+    int c;
+    if (strncmp(packet, "qSupported", 10) == 0) {
+        sprintf(reply, "PacketSize=%x;QStartNoAckMode+;qXfer:features:read+", GDB_PACKET_SIZE - 1);
+    } else if (strncmp(packet, "qXfer:features:read:target.xml:", 31) == 0) {
+        const char *p = packet + 31;
+        unsigned long start, length, size = strlen(gdbTargetXml);
+        start = gdbParseHex(&p);
+        p++;
+        length = gdbParseHex(&p);
+        if (start >= size) {
+            strcpy(reply, "l");
+        } else {
+            if (length > size - start)
+                length = size - start;
+            if (length > GDB_PACKET_SIZE - 2)
+                length = GDB_PACKET_SIZE - 2;
+            reply[0] = start + length == size ? 'l' : 'm';
+            memcpy(reply + 1, gdbTargetXml + start, length);
+            reply[1 + length] = '\0';
+        }
+    } else if (strcmp(packet, "qfThreadInfo") == 0) { //Every core is a thread, numbered from 1.
+        reply += sprintf(reply, "m1");
+        for (c = 1; c < numCores; c++) {
+            reply += sprintf(reply, ",%x", c + 1);
+        }
+    } else if (strcmp(packet, "qsThreadInfo") == 0) {
+        strcpy(reply, "l");
+    } else if (strcmp(packet, "qC") == 0) {
+        sprintf(reply, "QC%x", session->core + 1);
+    } else if (strcmp(packet, "qAttached") == 0) {
+        strcpy(reply, "1");
+    } else {
+        reply[0] = '\0';
+    }
+}
+
+//Opens a listening socket at where, a TCP port on the loopback interface if it is a number
+//and a Unix socket path otherwise, and waits for one client. Returns the connection or -1.
+int gdbAccept(const char *where) {
+    int listener, fd, on = 1;
+    char *end;
+    long port = strtol(where, &end, 10);
+    if (*end == '\0') {
+        struct sockaddr_in address;
+        listener = socket(AF_INET, SOCK_STREAM, 0);
+        setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        memset(&address, 0, sizeof(address));
+        address.sin_family = AF_INET;
+        address.sin_port = htons(port);
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (bind(listener, (struct sockaddr *) &address, sizeof(address)) < 0) {
+            printf("Error: Cannot listen on port %ld\n", port);
+            close(listener);
+            return -1;
+        }
+    } else {
+        struct sockaddr_un address;
+        listener = socket(AF_UNIX, SOCK_STREAM, 0);
+        memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        strncpy(address.sun_path, where, sizeof(address.sun_path) - 1);
+        unlink(where);
+        if (bind(listener, (struct sockaddr *) &address, sizeof(address)) < 0) {
+            printf("Error: Cannot listen on %s\n", where);
+            close(listener);
+            return -1;
+        }
+    }
+    listen(listener, 1);
+    printf("Waiting for a debugger on %s\n", where);
+    fflush(stdout);
+    fd = accept(listener, NULL, NULL);
+    close(listener);
+    if (fd >= 0 && *end == '\0')
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    return fd;
+}
+
+//Serves one GDB remote serial protocol session for the loaded program. Registers are R0-R7,
+//PC and CC as 16-bit little-endian values; memory is byte addressed with word x at byte 2x.
+//There is no execution history, so reverse step and continue get the empty "unsupported" reply.
+int gdbServe(const char *where, unsigned short start_address) {
+    static Gdb_Session session;
+    static char packet[GDB_PACKET_SIZE], reply[GDB_PACKET_SIZE + 1];
+    const char *p;
+    char *out;
+    int i;
+    session.fd = gdbAccept(where);
+    if (session.fd < 0)
+        return 1;
+    session.start_address = start_address;
+    clearBreakpoints(session.breakpoints);
+    
+    while (gdbReadPacket(&session, packet) >= 0) {
+        reply[0] = '\0';
+        switch (packet[0]) {
+            case '?':
+                sprintf(reply, "T%02xthread:%x;", GDB_SIGTRAP, session.core + 1);
+                break;
+            case 'g':
+                for (out = reply, i = 0; i < GDB_NUM_REGISTERS; i++) {
+                    out = gdbPutRegister(out, &session, i);
+                }
+                break;
+            case 'G':
+                for (p = packet + 1, i = 0; i < GDB_NUM_REGISTERS && *p; i++) {
+                    gdbSetRegister(&session, i, gdbGetRegisterValue(&p, i));
+                }
+                strcpy(reply, "OK");
+                break;
+            case 'p':
+                p = packet + 1;
+                i = gdbParseHex(&p);
+                if (i < GDB_NUM_REGISTERS)
+                    gdbPutRegister(reply, &session, i);
+                else
+                    strcpy(reply, "E01");
+                break;
+            case 'P':
+                p = packet + 1;
+                i = gdbParseHex(&p);
+                p++; //Skip the '='
+                if (i < GDB_NUM_REGISTERS) {
+                    gdbSetRegister(&session, i, gdbGetRegisterValue(&p, i));
+                    strcpy(reply, "OK");
+                } else {
+                    strcpy(reply, "E01");
+                }
+                break;
+            case 'm':
+            case 'M':
+                gdbMemory(&session, packet, reply);
+                break;
+            case 'c':
+            case '\003':
+                if (packet[0] == 'c' && packet[1]) {
+                    p = packet + 1;
+                    gdbSetRegister(&session, GDB_PC_REGISTER, gdbParseHex(&p));
+                }
+                if (packet[0] == 'c' && liveCores() > 0) {
+                    gdbContinue(&session);
+                } else {
+                    session.stopReason = INTERRUPTED;
+                    session.stoppedCore = session.core;
+                }
+                gdbStopReply(&session, reply);
+                break;
+            case 's':
+                if (!cores[session.core].halted) {
+                    stepCore(&cores[session.core], start_address);
+                    session.stopReason = watchHitType ? WATCHPOINT_REACHED : BREAKPOINT_REACHED;
+                }
+                session.stoppedCore = session.core;
+                gdbStopReply(&session, reply);
+                break;
+            case 'Z':
+            case 'z':
+                gdbBreakpoint(&session, packet, reply);
+                break;
+            case 'H': //Hg picks the core registers come from, Hc is ignored as c runs every core.
+                p = packet + 2;
+                i = gdbParseHex(&p);
+                if (packet[1] == 'g' && i >= 1 && i <= numCores)
+                    session.core = i - 1;
+                strcpy(reply, "OK");
+                break;
+            case 'T':
+                p = packet + 1;
+                i = gdbParseHex(&p);
+                strcpy(reply, i >= 1 && i <= numCores && !cores[i - 1].halted ? "OK" : "E01");
+                break;
+            case 'q':
+                gdbQuery(&session, packet, reply);
+                break;
+            case 'Q':
+                if (strcmp(packet, "QStartNoAckMode") == 0) {
+                    gdbSendPacket(&session, "OK");
+                    session.noAck = 1;
+                    continue;
+                }
+                break;
+            case 'D':
+                gdbSendPacket(&session, "OK");
+                close(session.fd);
+                return 0;
+            case 'k':
+                close(session.fd);
+                return 0;
+            default: //Includes bs and bc, reverse execution is not recorded.
+                break;
+        }
+        gdbSendPacket(&session, reply);
+    }
+    close(session.fd);
+    return 0;
+}
+
+//Lane vectors: one 16-bit register of every instance in a batch. AVX2 holds all BATCH_LANES
+//in one register, SSE2 in two, and without either the operations are plain loops.
+#if defined(__AVX2__)
+typedef __m256i Lane_Vector;
+
+static inline Lane_Vector laneLoad(const Register *p) { return _mm256_loadu_si256((const __m256i *) p); }
+static inline void laneStore(Register *p, Lane_Vector v) { _mm256_storeu_si256((__m256i *) p, v); }
+static inline Lane_Vector laneSet(Register x) { return _mm256_set1_epi16(x); }
+static inline Lane_Vector laneAdd(Lane_Vector a, Lane_Vector b) { return _mm256_add_epi16(a, b); }
+static inline Lane_Vector laneAnd(Lane_Vector a, Lane_Vector b) { return _mm256_and_si256(a, b); }
+static inline Lane_Vector laneOr(Lane_Vector a, Lane_Vector b) { return _mm256_or_si256(a, b); }
+static inline Lane_Vector laneAndNot(Lane_Vector a, Lane_Vector b) { return _mm256_andnot_si256(a, b); } //~a & b
+static inline Lane_Vector laneEqual(Lane_Vector a, Lane_Vector b) { return _mm256_cmpeq_epi16(a, b); }
+static inline Lane_Vector laneNegative(Lane_Vector a) { return _mm256_cmpgt_epi16(_mm256_setzero_si256(), a); }
+static inline unsigned int laneBits(Lane_Vector mask) {
+    return _mm_movemask_epi8(_mm_packs_epi16(_mm256_castsi256_si128(mask), _mm256_extracti128_si256(mask, 1)));
+}
+static inline Lane_Vector laneMask(unsigned int bits) {
+    const Lane_Vector laneBit = _mm256_setr_epi16(1 << 0, 1 << 1, 1 << 2, 1 << 3, 1 << 4, 1 << 5, 1 << 6, 1 << 7,
+        1 << 8, 1 << 9, 1 << 10, 1 << 11, 1 << 12, 1 << 13, 1 << 14, (short) (1 << 15));
+    return _mm256_cmpeq_epi16(_mm256_and_si256(_mm256_set1_epi16(bits), laneBit), laneBit);
+}
+#elif defined(__SSE2__)
+typedef struct Lane_Vector { __m128i low, high; } Lane_Vector;
+
+static inline Lane_Vector lanePair(__m128i low, __m128i high) { Lane_Vector v = {low, high}; return v; }
+static inline Lane_Vector laneLoad(const Register *p) {
+    return lanePair(_mm_loadu_si128((const __m128i *) p), _mm_loadu_si128((const __m128i *) (p + 8)));
+}
+static inline void laneStore(Register *p, Lane_Vector v) {
+    _mm_storeu_si128((__m128i *) p, v.low);
+    _mm_storeu_si128((__m128i *) (p + 8), v.high);
+}
+static inline Lane_Vector laneSet(Register x) { return lanePair(_mm_set1_epi16(x), _mm_set1_epi16(x)); }
+static inline Lane_Vector laneAdd(Lane_Vector a, Lane_Vector b) { return lanePair(_mm_add_epi16(a.low, b.low), _mm_add_epi16(a.high, b.high)); }
+static inline Lane_Vector laneAnd(Lane_Vector a, Lane_Vector b) { return lanePair(_mm_and_si128(a.low, b.low), _mm_and_si128(a.high, b.high)); }
+static inline Lane_Vector laneOr(Lane_Vector a, Lane_Vector b) { return lanePair(_mm_or_si128(a.low, b.low), _mm_or_si128(a.high, b.high)); }
+static inline Lane_Vector laneAndNot(Lane_Vector a, Lane_Vector b) { return lanePair(_mm_andnot_si128(a.low, b.low), _mm_andnot_si128(a.high, b.high)); }
+static inline Lane_Vector laneEqual(Lane_Vector a, Lane_Vector b) { return lanePair(_mm_cmpeq_epi16(a.low, b.low), _mm_cmpeq_epi16(a.high, b.high)); }
+static inline Lane_Vector laneNegative(Lane_Vector a) {
+    return lanePair(_mm_cmplt_epi16(a.low, _mm_setzero_si128()), _mm_cmplt_epi16(a.high, _mm_setzero_si128()));
+}
+static inline unsigned int laneBits(Lane_Vector mask) { return _mm_movemask_epi8(_mm_packs_epi16(mask.low, mask.high)); }
+static inline Lane_Vector laneMask(unsigned int bits) {
+    const __m128i low = _mm_setr_epi16(1 << 0, 1 << 1, 1 << 2, 1 << 3, 1 << 4, 1 << 5, 1 << 6, 1 << 7);
+    const __m128i high = _mm_setr_epi16(1 << 8, 1 << 9, 1 << 10, 1 << 11, 1 << 12, 1 << 13, 1 << 14, (short) (1 << 15));
+    __m128i all = _mm_set1_epi16(bits);
+    return lanePair(_mm_cmpeq_epi16(_mm_and_si128(all, low), low), _mm_cmpeq_epi16(_mm_and_si128(all, high), high));
+}
+#else
+typedef struct Lane_Vector { Register lane[BATCH_LANES]; } Lane_Vector;
+
+static inline Lane_Vector laneLoad(const Register *p) { Lane_Vector v; memcpy(v.lane, p, sizeof(v.lane)); return v; }
+static inline void laneStore(Register *p, Lane_Vector v) { memcpy(p, v.lane, sizeof(v.lane)); }
+static inline Lane_Vector laneSet(Register x) { Lane_Vector v; int i; for (i = 0; i < BATCH_LANES; i++) v.lane[i] = x; return v; }
+static inline Lane_Vector laneAdd(Lane_Vector a, Lane_Vector b) { int i; for (i = 0; i < BATCH_LANES; i++) a.lane[i] += b.lane[i]; return a; }
+static inline Lane_Vector laneAnd(Lane_Vector a, Lane_Vector b) { int i; for (i = 0; i < BATCH_LANES; i++) a.lane[i] &= b.lane[i]; return a; }
+static inline Lane_Vector laneOr(Lane_Vector a, Lane_Vector b) { int i; for (i = 0; i < BATCH_LANES; i++) a.lane[i] |= b.lane[i]; return a; }
+static inline Lane_Vector laneAndNot(Lane_Vector a, Lane_Vector b) { int i; for (i = 0; i < BATCH_LANES; i++) a.lane[i] = ~a.lane[i] & b.lane[i]; return a; }
+static inline Lane_Vector laneEqual(Lane_Vector a, Lane_Vector b) { int i; for (i = 0; i < BATCH_LANES; i++) a.lane[i] = a.lane[i] == b.lane[i] ? NEG_NUM_MASK : 0; return a; }
+static inline Lane_Vector laneNegative(Lane_Vector a) { int i; for (i = 0; i < BATCH_LANES; i++) a.lane[i] = (short) a.lane[i] < 0 ? NEG_NUM_MASK : 0; return a; }
+static inline unsigned int laneBits(Lane_Vector mask) { unsigned int bits = 0; int i; for (i = 0; i < BATCH_LANES; i++) bits |= (mask.lane[i] & 1) << i; return bits; }
+static inline Lane_Vector laneMask(unsigned int bits) { Lane_Vector v; int i; for (i = 0; i < BATCH_LANES; i++) v.lane[i] = (bits >> i) & 1 ? NEG_NUM_MASK : 0; return v; }
+#endif
+
+//Picks a where mask is set, b elsewhere.
+static inline Lane_Vector laneSelect(Lane_Vector mask, Lane_Vector a, Lane_Vector b) {
+    return laneOr(laneAnd(mask, a), laneAndNot(mask, b));
+}
+
+//Writes value into the lanes of p that mask selects, the other instances keep theirs.
+static inline void laneStoreMasked(Register *p, Lane_Vector value, Lane_Vector mask) {
+    laneStore(p, laneSelect(mask, value, laneLoad(p)));
+}
+
+//Vector conditionCode: N, Z or P for every lane.
+static inline Lane_Vector laneConditionCode(Lane_Vector result) {
+    Lane_Vector negative = laneNegative(result);
+    Lane_Vector zero = laneEqual(result, laneSet(0));
+    return laneSelect(negative, laneSet(N), laneSelect(zero, laneSet(Z), laneSet(P)));
+}
+
+//Sets an instance's register and, like setCC, its condition code.
+void batchSetRegister(Batch_p batch, int lane, Register Rd, Register value) {
+    batch->regFile[Rd][lane] = value;
+    batch->CC[lane] = conditionCode(value);
+}
+
+//Returns 1 if an instance may touch memory[address], otherwise stops it with LANE_FAULT.
+//The reference engine would index outside memory[] here.
+int batchAddress(Batch_p batch, int lane, Register address) {
+    if (address < SIZE_OF_MEM)
+        return 1;
+    batch->state[lane] = LANE_FAULT;
+    return 0;
+}
+
+//An instance's TRAP, as trap() does it: GETC reads the instance's input stream (0 once it runs
+//out) and console output goes to its output buffer. IN and PUTSP do nothing there either.
+void batchTrap(Batch_p batch, int lane, Register vector) {
+    Register address, oldValue;
+    switch (vector) {
+        case HALT:
+            batch->state[lane] = HALT;
+            break;
+        case GETC:
+            if (batch->inputPosition[lane] < batch->inputLength[lane])
+                batch->regFile[0][lane] = (char) batch->input[lane][batch->inputPosition[lane]++];
+            else
+                batch->regFile[0][lane] = 0;
+            break;
+        case OUT:
+            if (batch->outputLength[lane] < BATCH_OUTPUT_SIZE - 1)
+                batch->output[lane][batch->outputLength[lane]++] = batch->regFile[0][lane];
+            break;
+        case PUTS:
+            for (address = batch->regFile[0][lane]; batchAddress(batch, lane, address) && batch->memory[address][lane] != 0; address++) {
+                if (batch->outputLength[lane] < BATCH_OUTPUT_SIZE - 1)
+                    batch->output[lane][batch->outputLength[lane]++] = batch->memory[address][lane];
+            }
+            break;
+        case SWAP:
+            address = batch->regFile[1][lane];
+            if (batchAddress(batch, lane, address)) {
+                oldValue = batch->memory[address][lane];
+                batch->memory[address][lane] = batch->regFile[0][lane];
+                batch->regFile[0][lane] = oldValue;
+            }
+            break;
+        case CPUID: //Every instance runs as core 0.
+            batch->regFile[0][lane] = 0;
+            break;
+        default:
+            break;
+    }
+}
+
+//An instance's PUP, as pushOrPop does it.
+void batchPushOrPop(Batch_p batch, int lane, Register Rd, int pop, unsigned short start_address) {
+    Register *stack = &batch->regFile[6][lane];
+    if (pop) {
+        if (batchAddress(batch, lane, *stack - start_address))
+            batch->regFile[Rd][lane] = batch->memory[(Register) (*stack - start_address)][lane];
+        (*stack)++;
+    } else {
+        (*stack)--;
+        if (batchAddress(batch, lane, *stack - start_address))
+            batch->memory[(Register) (*stack - start_address)][lane] = batch->regFile[Rd][lane];
+    }
+}
+
+//Executes one instruction of a single instance with the same architectural effect as
+//completeOneInstructionCycle, minus the caches. Instances split off the lockstep group run here.
+void batchStepScalar(Batch_p batch, int lane, unsigned short start_address) {
+    Decoded_Instruction d;
+    Register pc = batch->PC[lane], address;
+    int running = batch->state[lane];
+    if (!batchAddress(batch, lane, pc))
+        return;
+    decodeInstruction(batch->memory[pc][lane], pc, &d);
+    batch->PC[lane] = ++pc;
+    switch (d.opcode) {
+        case ADD:
+            batchSetRegister(batch, lane, d.Rd, batch->regFile[d.Rs1][lane] + (d.immediate ? d.offset : batch->regFile[d.Rs2][lane]));
+            break;
+        case AND:
+            batchSetRegister(batch, lane, d.Rd, batch->regFile[d.Rs1][lane] & (d.immediate ? d.offset : batch->regFile[d.Rs2][lane]));
+            break;
+        case NOT:
+            batchSetRegister(batch, lane, d.Rd, ~batch->regFile[d.Rs1][lane]);
+            break;
+        case BR:
+            if (batch->CC[lane] & d.Rd)
+                batch->PC[lane] = pc + d.offset;
+            break;
+        case LD:
+            if (batchAddress(batch, lane, pc + d.offset))
+                batchSetRegister(batch, lane, d.Rd, batch->memory[(Register) (pc + d.offset)][lane]);
+            break;
+        case ST:
+            if (batchAddress(batch, lane, pc + d.offset))
+                batch->memory[(Register) (pc + d.offset)][lane] = batch->regFile[d.Rd][lane];
+            break;
+        case LDI:
+        case STI:
+            if (!batchAddress(batch, lane, pc + d.offset))
+                break;
+            address = batch->memory[(Register) (pc + d.offset)][lane] - start_address;
+            if (!batchAddress(batch, lane, address))
+                break;
+            if (d.opcode == LDI)
+                batchSetRegister(batch, lane, d.Rd, batch->memory[address][lane]);
+            else
+                batch->memory[address][lane] = batch->regFile[d.Rd][lane];
+            break;
+        case LDR:
+        case STR:
+            address = batch->regFile[d.Rs1][lane] + d.offset;
+            if (batch->CC[lane] & d.Rd) //The reference engine falls into BR here.
+                batch->PC[lane] = pc + d.offset;
+            if (!batchAddress(batch, lane, address))
+                break;
+            if (d.opcode == LDR)
+                batchSetRegister(batch, lane, d.Rd, batch->memory[address][lane]);
+            else
+                batch->memory[address][lane] = batch->regFile[d.Rd][lane];
+            break;
+        case LEA:
+            batchSetRegister(batch, lane, d.Rd, pc + d.offset);
+            break;
+        case JMP:
+            batch->PC[lane] = batch->regFile[d.Rs1][lane];
+            break;
+        case JSR:
+            batch->regFile[7][lane] = pc;
+            batch->PC[lane] = d.word & BIT_11_MASK ? pc + d.offset : batch->regFile[d.Rs1][lane];
+            break;
+        case TRAP:
+            batchTrap(batch, lane, d.word & TRAP_VECTOR_8_MASK);
+            break;
+        case PUP:
+            batchPushOrPop(batch, lane, d.Rd, d.word & POP_MASK, start_address);
+            break;
+        default:
+            break;
+    }
+    if (batch->state[lane] == running && batch->PC[lane] == SIZE_OF_MEM)
+        batch->state[lane] = END_OF_MEMORY;
+}
+
+//Executes the instruction at pc for every instance in group, which all have that PC and the
+//same word there. Register and ALU work is one vector operation for the whole group; memory
+//accesses through a register and traps go lane by lane.
+void batchStepVector(Batch_p batch, unsigned int group, Register pc, unsigned short start_address) {
+    Decoded_Instruction d;
+    Lane_Vector mask = laneMask(group), value, take;
+    unsigned int bits;
+    int lane;
+    decodeInstruction(batch->memory[pc][__builtin_ctz(group)], pc, &d);
+    pc++;
+    laneStoreMasked(batch->PC, laneSet(pc), mask);
+    switch (d.opcode) {
+        case ADD:
+        case AND:
+            value = d.immediate ? laneSet(d.offset) : laneLoad(batch->regFile[d.Rs2]);
+            value = d.opcode == ADD ? laneAdd(laneLoad(batch->regFile[d.Rs1]), value) : laneAnd(laneLoad(batch->regFile[d.Rs1]), value);
+            laneStoreMasked(batch->regFile[d.Rd], value, mask);
+            laneStoreMasked(batch->CC, laneConditionCode(value), mask);
+            break;
+        case NOT:
+            value = laneAndNot(laneLoad(batch->regFile[d.Rs1]), laneSet(NEG_NUM_MASK));
+            laneStoreMasked(batch->regFile[d.Rd], value, mask);
+            laneStoreMasked(batch->CC, laneConditionCode(value), mask);
+            break;
+        case BR: //Lanes that disagree on the branch split off at the next fetch.
+            take = laneEqual(laneAnd(laneLoad(batch->CC), laneSet(d.Rd)), laneSet(0));
+            laneStoreMasked(batch->PC, laneSelect(take, laneSet(pc), laneSet(pc + d.offset)), mask);
+            break;
+        case LD:
+            if ((Register) (pc + d.offset) >= SIZE_OF_MEM)
+                goto lane_by_lane;
+            value = laneLoad(batch->memory[(Register) (pc + d.offset)]);
+            laneStoreMasked(batch->regFile[d.Rd], value, mask);
+            laneStoreMasked(batch->CC, laneConditionCode(value), mask);
+            break;
+        case ST:
+            if ((Register) (pc + d.offset) >= SIZE_OF_MEM)
+                goto lane_by_lane;
+            laneStoreMasked(batch->memory[(Register) (pc + d.offset)], laneLoad(batch->regFile[d.Rd]), mask);
+            break;
+        case LEA:
+            laneStoreMasked(batch->regFile[d.Rd], laneSet(pc + d.offset), mask);
+            laneStoreMasked(batch->CC, laneSet(conditionCode(pc + d.offset)), mask);
+            break;
+        case JMP:
+            laneStoreMasked(batch->PC, laneLoad(batch->regFile[d.Rs1]), mask);
+            break;
+        case JSR:
+            laneStoreMasked(batch->regFile[7], laneSet(pc), mask); //Before reading Rs1, JSRR R7 jumps to itself.
+            laneStoreMasked(batch->PC, d.word & BIT_11_MASK ? laneSet(pc + d.offset) : laneLoad(batch->regFile[d.Rs1]), mask);
+            break;
+        default: //LDI, STI, LDR, STR, TRAP, PUP and anything that faults.
+        lane_by_lane:
+            for (bits = group; bits; bits &= bits - 1) {
+                lane = __builtin_ctz(bits);
+                batch->PC[lane] = pc - 1;
+                batchStepScalar(batch, lane, start_address);
+            }
+            return;
+    }
+    for (bits = laneBits(laneEqual(laneLoad(batch->PC), laneSet(SIZE_OF_MEM))) & group; bits; bits &= bits - 1) {
+        batch->state[__builtin_ctz(bits)] = END_OF_MEMORY;
+    }
+}
+
+//Runs a batch until every instance stops. Instances sharing a PC run in lockstep on the vector
+//kernel; when their PCs disagree the largest group carries on and the rest split off to wait
+//for the next round, where they are regrouped by PC. A group of one runs on batchStepScalar.
+void runBatch(Batch_p batch, unsigned short start_address, unsigned long maxSteps, unsigned long *lockstepInstructions) {
+    unsigned int waiting = (1u << batch->numLanes) - 1, running, group, other, bits;
+    unsigned long roundSteps, limit;
+    Register pc, otherPC;
+    int lane;
+    while (waiting) {
+        running = waiting;
+        waiting = 0;
+        limit = maxSteps; //Steps until the first running instance times out.
+        for (bits = running; bits; bits &= bits - 1) {
+            lane = __builtin_ctz(bits);
+            batch->state[lane] = LANE_RUNNING;
+            if (maxSteps - batch->steps[lane] < limit)
+                limit = maxSteps - batch->steps[lane];
+        }
+        for (roundSteps = 0; running; roundSteps++) {
+            if (roundSteps >= limit) { //The others split off and carry on next round.
+                for (bits = running; bits; bits &= bits - 1) {
+                    lane = __builtin_ctz(bits);
+                    if (batch->steps[lane] + roundSteps >= maxSteps)
+                        batch->state[lane] = LANE_TIMEOUT;
+                }
+                group = 0;
+            } else if (__builtin_popcount(running) == 1) { //Alone, the scalar engine is cheaper.
+                lane = __builtin_ctz(running);
+                batch->steps[lane] += roundSteps;
+                while (batch->state[lane] == LANE_RUNNING && batch->steps[lane] < maxSteps) {
+                    batchStepScalar(batch, lane, start_address);
+                    batch->steps[lane]++;
+                }
+                if (batch->state[lane] == LANE_RUNNING)
+                    batch->state[lane] = LANE_TIMEOUT;
+                group = 0;
+                roundSteps = 0; //Already counted.
+            } else {
+                pc = batch->PC[__builtin_ctz(running)];
+                group = laneBits(laneEqual(laneLoad(batch->PC), laneSet(pc))) & running;
+                if (__builtin_popcount(group) * 2 < __builtin_popcount(running)) { //Follow the majority.
+                    otherPC = batch->PC[__builtin_ctz(running & ~group)];
+                    other = laneBits(laneEqual(laneLoad(batch->PC), laneSet(otherPC))) & running;
+                    if (__builtin_popcount(other) > __builtin_popcount(group)) {
+                        group = other;
+                        pc = otherPC;
+                    }
+                }
+                if (pc < SIZE_OF_MEM) //Self-modifying code can leave different instructions at the same PC.
+                    group &= laneBits(laneEqual(laneLoad(batch->memory[pc]), laneSet(batch->memory[pc][__builtin_ctz(group)])));
+            }
+            for (bits = running & ~group; bits; bits &= bits - 1) { //Split off or stopped.
+                lane = __builtin_ctz(bits);
+                batch->steps[lane] += roundSteps;
+                if (batch->state[lane] == LANE_RUNNING) {
+                    batch->state[lane] = LANE_SPLIT;
+                    waiting |= 1u << lane;
+                }
+            }
+            running = group;
+            if (running == 0)
+                break;
+            if (pc >= SIZE_OF_MEM) { //Every lane of the group faults on the fetch.
+                for (bits = group; bits; bits &= bits - 1)
+                    batchStepScalar(batch, __builtin_ctz(bits), start_address);
+            } else {
+                batchStepVector(batch, group, pc, start_address);
+                *lockstepInstructions += __builtin_popcount(group);
+            }
+            for (bits = group; bits; bits &= bits - 1) {
+                lane = __builtin_ctz(bits);
+                if (batch->state[lane] != LANE_RUNNING) {
+                    batch->steps[lane] += roundSteps + 1;
+                    running &= ~(1u << lane);
+                }
+            }
+        }
+    }
+}
+
+//Reads the GETC streams of a batch run, one instance per line. \n, \t, \\ and \xNN escapes let
+//one line hold several lines of console input. Returns the number of instances, or -1.
+int readBatchInputs(const char *fileName, char ***inputs, int **lengths) {
+    FILE *fp = fopen(fileName, "r");
+    char line[BATCH_OUTPUT_SIZE], *in, *out;
+    int count = 0, capacity = 0;
+    if (fp == NULL) {
+        printf("Error: File not found.\n");
+        return -1;
+    }
+    *inputs = NULL;
+    *lengths = NULL;
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        line[strcspn(line, "\r\n")] = '\0';
+        for (in = out = line; *in; in++) {
+            if (*in == '\\' && in[1] == 'x' && isxdigit((unsigned char) in[2]) && isxdigit((unsigned char) in[3])) {
+                *out++ = gdbHexDigit(in[2]) << 4 | gdbHexDigit(in[3]);
+                in += 3;
+            } else if (*in == '\\' && in[1]) {
+                in++;
+                *out++ = *in == 'n' ? '\n' : *in == 't' ? '\t' : *in;
+            } else {
+                *out++ = *in;
+            }
+        }
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : BATCH_LANES;
+            *inputs = realloc(*inputs, capacity * sizeof(char *));
+            *lengths = realloc(*lengths, capacity * sizeof(int));
+        }
+        (*lengths)[count] = out - line;
+        (*inputs)[count] = malloc(out - line + 1);
+        memcpy((*inputs)[count], line, out - line + 1);
+        count++;
+    }
+    fclose(fp);
+    return count;
+}
+
+//Prints text with control characters escaped, so each instance's output stays on one line.
+//readBatchInputs reads it back.
+void printEscaped(FILE *fp, const char *text, int length) {
+    int i;
+    for (i = 0; i < length; i++) {
+        if (text[i] == '\n')
+            fprintf(fp, "\\n");
+        else if (text[i] == '\\')
+            fprintf(fp, "\\\\");
+        else if (isprint((unsigned char) text[i]))
+            fprintf(fp, "%c", text[i]);
+        else
+            fprintf(fp, "\\x%02X", (unsigned char) text[i]);
+    }
+}
+
+//Runs the loaded program once per line of inputFile, BATCH_LANES instances at a time, and
+//prints each instance's console output and how it stopped. Caches, latency and counters are
+//not modelled, only the architectural state. Returns 0, or 1 if the inputs cannot be read.
+int runBatchFile(const char *inputFile, unsigned short start_address) {
+    static const char *stopNames[] = {"", "", "end of memory", "", "", "", "", "", "", "timeout", "fault"};
+    Batch_p batch = malloc(sizeof(Batch_s));
+    char **inputs;
+    int *lengths;
+    int count = readBatchInputs(inputFile, &inputs, &lengths), first, lane, a;
+    unsigned long lockstep = 0, total = 0, started = monitorClock(), elapsed;
+    if (count < 0) {
+        free(batch);
+        return 1;
+    }
+    for (first = 0; first < count; first += BATCH_LANES) {
+        memset(batch, 0, sizeof(Batch_s));
+        batch->numLanes = count - first < BATCH_LANES ? count - first : BATCH_LANES;
+        for (lane = 0; lane < batch->numLanes; lane++) {
+            batch->CC[lane] = Z;
+            batch->input[lane] = inputs[first + lane];
+            batch->inputLength[lane] = lengths[first + lane];
+        }
+        for (a = 0; a < SIZE_OF_MEM; a++) {
+            laneStore(batch->memory[a], laneSet(memory[a]));
+        }
+        runBatch(batch, start_address, BATCH_MAX_STEPS, &lockstep);
+        for (lane = 0; lane < batch->numLanes; lane++) {
+            printf("%d: ", first + lane + 1);
+            printEscaped(stdout, batch->output[lane], batch->outputLength[lane]);
+            if (batch->state[lane] != HALT)
+                printf(" [%s]", stopNames[batch->state[lane]]);
+            printf("\n");
+            total += batch->steps[lane];
+            free(inputs[first + lane]);
+        }
+    }
+    elapsed = monitorClock() - started;
+    printf("Batch: %d instances, %lu instructions (%lu%% in lockstep) in %lu ms\n", count, total,
+           total ? lockstep * 100 / total : 0, elapsed);
+    free(inputs);
+    free(lengths);
+    free(batch);
+    return 0;
+}
+
+//xorshift64*, so a seed generates the same programs on every host.
+unsigned int fuzzRandom(unsigned long long *state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return (*state * 0x2545F4914F6CDD1DULL) >> 32;
+}
+
+//Returns a random number below n.
+int fuzzPick(unsigned long long *state, int n) {
+    return fuzzRandom(state) % n;
+}
+
+//Assembles an instruction from its fields. low holds the bits below Rs1.
+Register fuzzWord(int opcode, int Rd, int Rs1, int low) {
+    return opcode << OPCODE_SHIFT_AMT | Rd << DEST_REG_SHIFT_AMT | Rs1 << SOURCE1_SHIFT_AMT | low;
+}
+
+//Assembles a PC-relative instruction at address that reaches target through the offset field mask.
+Register fuzzRelative(int opcode, int Rd, int address, int target, Register mask) {
+    return opcode << OPCODE_SHIFT_AMT | Rd << DEST_REG_SHIFT_AMT | ((target - address - 1) & mask);
+}
+
+//A random ADD, AND or NOT writing Rd.
+Register fuzzAlu(int Rd, unsigned long long *state) {
+    int opcode = fuzzPick(state, 3) ? ADD : AND, Rs1 = fuzzPick(state, 8);
+    if (fuzzPick(state, 5) == 0)
+        return fuzzWord(NOT, Rd, Rs1, PCOFFSET6_MASK);
+    if (fuzzPick(state, 2))
+        return fuzzWord(opcode, Rd, Rs1, BIT_5_MASK | (fuzzRandom(state) & IMMED5_MASK));
+    return fuzzWord(opcode, Rd, Rs1, fuzzPick(state, 8));
+}
+
+//An LDR or STR through R5. The reference engine also branches by the offset when CC matches the
+//Rd field, so unless Rd is R0 the offset is one that lands on a slot start.
+Register fuzzBaseOffset(Fuzz_Program *program, int address, unsigned long long *state) {
+    int opcode = fuzzPick(state, 2) ? LDR : STR;
+    int Rd = fuzzPick(state, opcode == LDR ? 5 : 8), reach[2 * FUZZ_DATA_SIZE], n = 0, i, offset;
+    for (i = 0; i < program->numSlots; i++) {
+        offset = program->slotStart[i] - (address + 1);
+        if (offset >= -FUZZ_DATA_SIZE / 2 && offset < FUZZ_DATA_SIZE / 2)
+            reach[n++] = offset;
+    }
+    if (n == 0)
+        Rd = 0;
+    offset = Rd == 0 ? fuzzPick(state, FUZZ_DATA_SIZE) - FUZZ_DATA_SIZE / 2 : reach[fuzzPick(state, n)];
+    return fuzzWord(opcode, Rd, 5, offset & PCOFFSET6_MASK);
+}
+
+//A random instruction at address that stands on its own.
+Register fuzzInstruction(Fuzz_Program *program, int address, unsigned long long *state) {
+    static const int vectors[] = {GETC, GETC, OUT, OUT, CPUID, IN, PUTSP, 0x30, HALT};
+    int Rd = fuzzPick(state, 5), Rs = fuzzPick(state, 8);
+    int target = program->slotStart[fuzzPick(state, program->numSlots)];
+    int data = FUZZ_DATA + fuzzPick(state, FUZZ_DATA_SIZE);
+    int indirect = FUZZ_POOL + fuzzPick(state, FUZZ_NUM_POINTERS);
+    switch (fuzzPick(state, 16)) {
+        case 0:
+        case 1:
+        case 2:
+        case 3:
+            return fuzzAlu(Rd, state);
+        case 4:
+            return fuzzRelative(LEA, Rd, address, fuzzPick(state, FUZZ_IMAGE_SIZE), PCOFFSET9_MASK);
+        case 5: //The pool, or the data.
+            return fuzzRelative(LD, Rd, address, FUZZ_POOL + fuzzPick(state, FUZZ_DATA + FUZZ_DATA_SIZE - FUZZ_POOL), PCOFFSET9_MASK);
+        case 6:
+            return fuzzRelative(ST, Rs, address, data, PCOFFSET9_MASK);
+        case 7:
+            if (fuzzPick(state, 2))
+                return fuzzRelative(LDI, Rd, address, indirect, PCOFFSET9_MASK);
+            return fuzzRelative(STI, Rs, address, indirect, PCOFFSET9_MASK);
+        case 8:
+        case 9:
+            return fuzzBaseOffset(program, address, state);
+        case 10:
+        case 11:
+            return fuzzRelative(BR, fuzzPick(state, 8), address, target, PCOFFSET9_MASK);
+        case 12:
+            return fuzzRelative(JSR, 0, address, target, PCOFFSET11_MASK) | BIT_11_MASK;
+        case 13: //RET, or JSRR R7, which sets R7 first and so goes on with the next instruction.
+            return fuzzWord(fuzzPick(state, 2) ? JMP : JSR, 0, 7, 0);
+        case 14:
+            return fuzzWord(TRAP, 0, 0, vectors[fuzzPick(state, sizeof(vectors) / sizeof(vectors[0]))]);
+        default: //RTI, which does nothing here.
+            return fuzzWord(8, 0, 0, 0) | (fuzzRandom(state) & PCOFFSET11_MASK);
+    }
+}
+
+//Writes a push of register r at address and returns its length. PUP pushes unless the program
+//keeps its stack with ADD and STR through R6, which the superblocks fuse.
+int fuzzPush(Register *code, int address, int softwareStack, int r) {
+    if (!softwareStack) {
+        code[address] = fuzzWord(PUP, r, 0, 0);
+        return 1;
+    }
+    code[address] = fuzzWord(ADD, 6, 6, BIT_5_MASK | IMMED5_MASK);
+    code[address + 1] = fuzzWord(STR, r, 6, 0);
+    return 2;
+}
+
+//Writes a pop into register r at address and returns its length.
+int fuzzPop(Register *code, int address, int softwareStack, int r) {
+    if (!softwareStack) {
+        code[address] = fuzzWord(PUP, r, 0, POP_MASK);
+        return 1;
+    }
+    code[address] = fuzzWord(LDR, r, 6, 0);
+    code[address + 1] = fuzzWord(ADD, 6, 6, BIT_5_MASK | 1);
+    return 2;
+}
+
+//Fills a slot with pushes, an optional ALU instruction, and as many pops. Returns 0 if not even
+//one push and its pop fit.
+int fuzzStackSlot(Register *code, int address, int length, int softwareStack, unsigned long long *state) {
+    int width = softwareStack ? 2 : 1, depth = length / (2 * width), i;
+    if (depth == 0)
+        return 0;
+    if (depth > 2)
+        depth = 2;
+    for (i = 0; i < depth; i++)
+        address += fuzzPush(code, address, softwareStack, fuzzPick(state, 8));
+    for (i = length - 2 * width * depth; i > 0; i--)
+        code[address++] = fuzzAlu(fuzzPick(state, 5), state);
+    for (i = 0; i < depth; i++)
+        address += fuzzPop(code, address, softwareStack, fuzzPick(state, 5));
+    return 1;
+}
+
+//Fills one slot of a program with instructions that are only valid together, or a single one.
+void fuzzSlot(Fuzz_Program *program, int slot, int softwareStack, int strings[], unsigned long long *state) {
+    Register *code = program->image;
+    int a = program->slotStart[slot], length = program->slotStart[slot + 1] - a;
+    int Rd = fuzzPick(state, 5), Rs = fuzzPick(state, 8);
+    int target = program->slotStart[fuzzPick(state, program->numSlots)];
+    if (length == 1) {
+        code[a] = fuzzInstruction(program, a, state);
+    } else if (length == 2) {
+        switch (fuzzPick(state, 7)) {
+            case 0:
+                code[a] = fuzzRelative(LEA, 0, a, strings[fuzzPick(state, FUZZ_NUM_STRINGS)], PCOFFSET9_MASK);
+                code[a + 1] = fuzzWord(TRAP, 0, 0, PUTS);
+                break;
+            case 1:
+                code[a] = fuzzWord(ADD, 1, 5, BIT_5_MASK | (fuzzRandom(state) & IMMED5_MASK));
+                code[a + 1] = fuzzWord(TRAP, 0, 0, SWAP);
+                break;
+            case 2: //A delay loop fastForwardCountdown may take.
+                code[a] = fuzzWord(ADD, Rd, Rd, BIT_5_MASK | (fuzzRandom(state) & IMMED5_MASK));
+                code[a + 1] = fuzzWord(BR, fuzzPick(state, 8), 0, LOOP_BACK_OFFSET);
+                break;
+            case 3:
+                code[a] = fuzzWord(NOT, Rd, Rs, PCOFFSET6_MASK);
+                code[a + 1] = fuzzWord(ADD, Rd, Rd, BIT_5_MASK | 1);
+                break;
+            case 4: //Computed jump or call, R4 is overwritten anyway.
+                code[a] = fuzzRelative(LEA, 4, a, target, PCOFFSET9_MASK);
+                code[a + 1] = fuzzWord(fuzzPick(state, 2) ? JMP : JSR, 0, 4, 0);
+                break;
+            default:
+                if (fuzzStackSlot(code, a, length, softwareStack, state))
+                    break;
+                code[a] = fuzzAlu(Rd, state);
+                code[a + 1] = fuzzRelative(BR, fuzzPick(state, 8), a + 1, target, PCOFFSET9_MASK);
+                break;
+        }
+    } else if (fuzzPick(state, 2) == 0 || !fuzzStackSlot(code, a, length, softwareStack, state)) {
+        code[a] = fuzzRelative(LD, Rd, a, FUZZ_DATA + fuzzPick(state, FUZZ_DATA_SIZE), PCOFFSET9_MASK);
+        code[a + 1] = fuzzWord(ADD, fuzzPick(state, 5), Rd, BIT_5_MASK | (fuzzRandom(state) & IMMED5_MASK));
+        code[a + 2] = fuzzRelative(BR, fuzzPick(state, 8), a + 2, target, PCOFFSET9_MASK);
+        for (a += 3; a < program->slotStart[slot + 1]; a++)
+            code[a] = fuzzAlu(fuzzPick(state, 5), state);
+    }
+}
+
+//Returns the start of a random slot, not the prologue or the final HALT, of minLength to maxLength
+//words, or -1 if there is none.
+int fuzzPickSlot(Fuzz_Program *program, int minLength, int maxLength, unsigned long long *state) {
+    int slot = 1 + fuzzPick(state, program->numSlots - 2), tries, length;
+    for (tries = 0; tries < program->numSlots - 2; tries++, slot = 1 + slot % (program->numSlots - 2)) {
+        length = program->slotStart[slot + 1] - program->slotStart[slot];
+        if (length >= minLength && length <= maxLength)
+            return program->slotStart[slot];
+    }
+    return -1;
+}
+
+//Turns a slot of four or more words into a store of a new instruction over a one-word slot, so
+//code is rewritten whether or not it has run yet. The new word keeps the rules of fuzzGenerate.
+void fuzzSelfModify(Fuzz_Program *program, unsigned long long *state) {
+    Register *code = program->image;
+    int a = fuzzPickSlot(program, 4, FUZZ_MAX_SLOT, state), target = fuzzPickSlot(program, 1, 1, state), Rd = fuzzPick(state, 5);
+    if (a < 0 || target < 0)
+        return;
+    code[a] = fuzzRelative(LD, Rd, a, a + 3, PCOFFSET9_MASK);
+    code[a + 1] = fuzzRelative(ST, Rd, a + 1, target, PCOFFSET9_MASK);
+    code[a + 2] = fuzzRelative(BR, NZP_MASK, a + 2, a + 4, PCOFFSET9_MASK); //Over the new word.
+    code[a + 3] = fuzzInstruction(program, target, state);
+}
+
+//Generates a random program and input that stay inside the image whichever path they take. Only
+//R0-R4 are ever written; R5 points into the data, R6 at the stack, and R7 holds 0 or the address
+//after a JSR, which is the start of a slot. Loads and stores reach only the data, the stack and,
+//through fuzzSelfModify, the code, so the PUP quirk of going around the data cache never shows.
+//Programs run on one core; MESI between cores is not covered.
+void fuzzGenerate(Fuzz_Program *program, unsigned long long *state) {
+    Register *code = program->image;
+    int strings[FUZZ_NUM_STRINGS], softwareStack = fuzzPick(state, 2), a, i, n, length;
+    memset(program, 0, sizeof(Fuzz_Program));
+    //R6 is an absolute address for PUP but a memory offset for LDR/STR, the same only at x0000.
+    program->origin = softwareStack ? 0 : (1 + fuzzPick(state, 14)) << 12;
+    for (i = 0; i < FUZZ_NUM_POINTERS; i++)
+        code[FUZZ_POOL + i] = program->origin + FUZZ_DATA + fuzzPick(state, FUZZ_DATA_SIZE);
+    code[FUZZ_STACK_POINTER] = program->origin + FUZZ_STACK_TOP;
+    for (a = FUZZ_STACK_POINTER + 1, i = 0; i < FUZZ_NUM_STRINGS; i++) {
+        strings[i] = a;
+        for (n = fuzzPick(state, FUZZ_STRING_SIZE); n > 0; n--)
+            code[a++] = ' ' + fuzzPick(state, '~' - ' ' + 1);
+        code[a++] = 0;
+    }
+    for (a = FUZZ_DATA; a < FUZZ_IMAGE_SIZE; a++)
+        code[a] = fuzzRandom(state);
+    program->inputLength = fuzzPick(state, FUZZ_INPUT_SIZE + 1);
+    for (i = 0; i < program->inputLength; i++)
+        program->input[i] = fuzzRandom(state);
+    
+    code[0] = fuzzRelative(LEA, 5, 0, FUZZ_DATA + FUZZ_DATA_SIZE / 2, PCOFFSET9_MASK);
+    code[1] = fuzzRelative(LD, 6, 1, FUZZ_STACK_POINTER, PCOFFSET9_MASK);
+    program->slotStart[program->numSlots++] = 0;
+    for (a = 2; a < FUZZ_CODE_SIZE - 1; a += length) {
+        n = fuzzPick(state, 20);
+        length = n < 12 ? 1 : n < 17 ? 2 : n < 18 ? 3 : n < 19 ? 4 : FUZZ_MAX_SLOT;
+        if (a + length > FUZZ_CODE_SIZE - 1)
+            length = FUZZ_CODE_SIZE - 1 - a;
+        program->slotStart[program->numSlots++] = a;
+    }
+    program->slotStart[program->numSlots++] = FUZZ_CODE_SIZE - 1;
+    program->slotStart[program->numSlots] = FUZZ_CODE_SIZE; //End of the final HALT.
+    code[FUZZ_CODE_SIZE - 1] = fuzzWord(TRAP, 0, 0, HALT);
+    for (i = 1; i < program->numSlots - 1; i++)
+        fuzzSlot(program, i, softwareStack, strings, state);
+    for (n = fuzzPick(state, 3); n > 0; n--)
+        fuzzSelfModify(program, state);
+}
+
+//Turns a slot of three or more words into a load from a performance counter register, for
+//FUZZ_SUPERBLOCK only as the batch engines have no counters. Superblocks side exit there, and
+//whatever they and fast-forwarding counted has to match the reference exactly.
+void fuzzPerfLoad(Fuzz_Program *program, unsigned long long *state) {
+    Register *code = program->image;
+    int a = fuzzPickSlot(program, 3, FUZZ_MAX_SLOT, state);
+    if (a < 0)
+        return;
+    code[a] = fuzzRelative(LDI, fuzzPick(state, 5), a, a + 2, PCOFFSET9_MASK);
+    code[a + 1] = fuzzRelative(BR, NZP_MASK, a + 1, a + 3, PCOFFSET9_MASK); //Over the pointer.
+    code[a + 2] = PERF_CYCLE_LO + fuzzPick(state, PERF_CONTROL - PERF_CYCLE_LO + 1);
+}
+
+//Turns a slot of three or more words into a jump past the end of memory, for FUZZ_LOCKSTEP only as
+//the reference engine does not fault there. Every lane reaching it together leaves the lockstep
+//group at the same out-of-range PC. R4 is overwritten anyway.
+void fuzzWildJump(Fuzz_Program *program, unsigned long long *state) {
+    Register *code = program->image;
+    int a = fuzzPickSlot(program, 3, FUZZ_MAX_SLOT, state);
+    if (a < 0)
+        return;
+    code[a] = fuzzRelative(LD, 4, a, a + 2, PCOFFSET9_MASK);
+    code[a + 1] = fuzzWord(JMP, 0, 4, 0);
+    code[a + 2] = program->origin + SIZE_OF_MEM + fuzzPick(state, FUZZ_DATA_SIZE);
+}
+
+//Points memory, the cores, codePages and the guest console at a machine.
+void fuzzSwitch(Fuzz_Machine *machine) {
+    memory = machine->memory;
+    cores = machine->cores;
+    codePages = machine->codePages;
+    consoleScript = &machine->console;
+}
+
+//Loads a program into a machine and resets its cores, caches and console.
+void fuzzReset(Fuzz_Machine *machine, Fuzz_Program *program) {
+    fuzzSwitch(machine);
+    memset(machine->memory, 0, sizeof(machine->memory));
+    memcpy(machine->memory, program->image, sizeof(program->image));
+    initializeCaches();
+    initializeCores(program->origin);
+    memset(&machine->console, 0, sizeof(Console_Script));
+    machine->console.input = program->input;
+    machine->console.inputLength = program->inputLength;
+}
+
+//Loads a program into the first lanes of a batch.
+void fuzzResetBatch(Batch_p batch, Fuzz_Program *program, int lanes) {
+    int a, lane;
+    memset(batch, 0, sizeof(Batch_s));
+    batch->numLanes = lanes;
+    for (lane = 0; lane < lanes; lane++) {
+        batch->CC[lane] = Z;
+        batch->input[lane] = program->input;
+        batch->inputLength[lane] = program->inputLength;
+    }
+    for (a = 0; a < FUZZ_IMAGE_SIZE; a++) {
+        laneStore(batch->memory[a], laneSet(program->image[a]));
+    }
+}
+
+//Formats a difference into detail. Returns 1, so a comparison can return it.
+int fuzzReport(char *detail, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    vsnprintf(detail, FUZZ_DETAIL_SIZE, format, args);
+    va_end(args);
+    return 1;
+}
+
+//Compares the candidate machine's core with the reference core: registers, PC, CC, how it
+//stopped, the console output, the first words of memory[] and the data cache lines either one
+//holds Modified there. Returns 1 with the first difference in detail, or 0.
+int fuzzCompareCores(Fuzz_Machine *reference, Fuzz_Machine *candidate, int words, char *detail) {
+    Core_p ref = &reference->cores[0], core = &candidate->cores[0];
+    Cache_Entry *line, *refLine;
+    int i;
+    for (i = 0; i < 8; i++) {
+        if (core->cpu.regFile[i] != ref->cpu.regFile[i])
+            return fuzzReport(detail, "R%d is x%04X, reference x%04X", i, core->cpu.regFile[i], ref->cpu.regFile[i]);
+    }
+    if (core->cpu.PC != ref->cpu.PC)
+        return fuzzReport(detail, "PC is x%04X, reference x%04X", (Register) (core->cpu.PC + ref->cpu.origin), (Register) (ref->cpu.PC + ref->cpu.origin));
+    if (core->cpu.CC != ref->cpu.CC)
+        return fuzzReport(detail, "CC is %d, reference %d", core->cpu.CC, ref->cpu.CC);
+    if (core->halted != ref->halted)
+        return fuzzReport(detail, "stop state is %d, reference %d", core->halted, ref->halted);
+    if (candidate->console.outputLength != reference->console.outputLength
+        || memcmp(candidate->console.output, reference->console.output, reference->console.outputLength) != 0)
+        return fuzzReport(detail, "console output differs");
+    if (memcmp(candidate->memory, reference->memory, words * sizeof(Register)) != 0) {
+        for (i = 0; candidate->memory[i] == reference->memory[i]; i++);
+        return fuzzReport(detail, "memory[x%04X] is x%04X, reference x%04X", (Register) (i + ref->cpu.origin), candidate->memory[i], reference->memory[i]);
+    }
+    for (i = 0; i < SIZE_OF_CACHE && i < words; i++) {
+        line = &core->dataCache[i];
+        refLine = &ref->dataCache[i];
+        if (((line->entryInfo | refLine->entryInfo) & DIRTY_BIT_MASK) && (line->entryInfo != refLine->entryInfo || line->data != refLine->data))
+            return fuzzReport(detail, "dirty cache line %d is x%04X/x%04X, reference x%04X/x%04X", i,
+                              line->entryInfo, line->data, refLine->entryInfo, refLine->data);
+    }
+    return 0;
+}
+
+//Compares the registers, PC, CC, stop state and console output of one lane of a batch with the
+//reference core. A lane stopped for running too long matches a reference that has not halted, and
+//a lane that faulted on a fetch one left with its PC past the end of memory.
+int fuzzCompareLane(Fuzz_Machine *reference, Batch_p batch, int lane, char *detail) {
+    Core_p ref = &reference->cores[0];
+    int i, expected = ref->halted;
+    if (!expected && ref->cpu.PC >= SIZE_OF_MEM)
+        expected = LANE_FAULT;
+    else if (!expected && batch->state[lane] == LANE_TIMEOUT)
+        expected = LANE_TIMEOUT;
+    for (i = 0; i < 8; i++) {
+        if (batch->regFile[i][lane] != ref->cpu.regFile[i])
+            return fuzzReport(detail, "lane %d R%d is x%04X, reference x%04X", lane, i, batch->regFile[i][lane], ref->cpu.regFile[i]);
+    }
+    if (batch->PC[lane] != ref->cpu.PC)
+        return fuzzReport(detail, "lane %d PC is x%04X, reference x%04X", lane, (Register) (batch->PC[lane] + ref->cpu.origin), (Register) (ref->cpu.PC + ref->cpu.origin));
+    if (batch->CC[lane] != ref->cpu.CC)
+        return fuzzReport(detail, "lane %d CC is %d, reference %d", lane, batch->CC[lane], ref->cpu.CC);
+    if (batch->state[lane] != expected)
+        return fuzzReport(detail, "lane %d stop state is %d, reference %d", lane, batch->state[lane], expected);
+    if (batch->outputLength[lane] != reference->console.outputLength
+        || memcmp(batch->output[lane], reference->console.output, reference->console.outputLength) != 0)
+        return fuzzReport(detail, "lane %d console output differs", lane);
+    return 0;
+}
+
+//Compares the first words of memory in every lane of a batch with expected, memory as the
+//reference core would read it, Modified cache lines included. One vector compare per word.
+int fuzzCompareLaneMemory(Batch_p batch, const Register expected[], int words, Register origin, char *detail) {
+    unsigned int lanes = (1u << batch->numLanes) - 1, same;
+    int i, lane;
+    for (i = 0; i < words; i++) {
+        same = laneBits(laneEqual(laneLoad(batch->memory[i]), laneSet(expected[i]))) | ~lanes;
+        if (same != ~0u) {
+            lane = __builtin_ctz(~same);
+            return fuzzReport(detail, "lane %d memory[x%04X] is x%04X, reference x%04X", lane, (Register) (i + origin), batch->memory[i][lane], expected[i]);
+        }
+    }
+    return 0;
+}
+
+//Returns 1 if an instruction can write memory.
+int fuzzMayStore(Register word) {
+    switch (word >> OPCODE_SHIFT_AMT) {
+        case ST:
+        case STR:
+        case STI:
+        case PUP:
+        case TRAP:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+//Starting value of R0-R4, which generated code never relies on, in one lane of FUZZ_LOCKSTEP:
+//negative, zero and positive across the lanes, so their first branches already split them.
+Register fuzzLaneRegister(int lane, int r) {
+    return (lane - BATCH_LANES / 2) * (r + 1);
+}
+
+//Runs a program on the reference engine and on a candidate engine, and compares them after every
+//step of the candidate: whatever runStep executes for FUZZ_SUPERBLOCK, one instruction for the
+//batch engines. Memory is compared after every step that can write it, and all of it at the end.
+//FUZZ_LOCKSTEP gives lane n the input from its nth character on and its own R0-R4, and is only
+//compared at the end, lane by lane, step counts included. Returns 1 with the first difference in
+//detail, or 0 if they agree to the end. instructions is how far the reference engine got.
+int fuzzRun(Fuzz_Machine machines[], Batch_p batch, Fuzz_Program *program, int engine, char *detail, unsigned long *instructions) {
+    Fuzz_Machine *reference = &machines[0], *candidate = &machines[1];
+    Core_p ref = &reference->cores[0], core = &candidate->cores[0];
+    Register breakpoints[MAX_NUM_BKPTS], expected[SIZE_OF_MEM], pc;
+    int numBreakpoints = 0, lanes = engine == FUZZ_VECTOR ? BATCH_LANES : 1, lane, words, i, differ = 0;
+    unsigned long lockstep = 0, total = 0, steps;
+    clearBreakpoints(breakpoints);
+    fuzzReset(reference, program);
+    if (engine == FUZZ_LOCKSTEP) {
+        fuzzResetBatch(batch, program, BATCH_LANES);
+        for (lane = 0; lane < BATCH_LANES; lane++) {
+            for (i = 0; i < 5; i++)
+                batch->regFile[i][lane] = fuzzLaneRegister(lane, i);
+            if (lane < program->inputLength) {
+                batch->input[lane] += lane;
+                batch->inputLength[lane] -= lane;
+            }
+        }
+        runBatch(batch, program->origin, FUZZ_MAX_STEPS, &lockstep);
+        for (lane = 0; lane < BATCH_LANES && !differ; lane++) {
+            fuzzReset(reference, program);
+            reference->console.input = batch->input[lane];
+            reference->console.inputLength = batch->inputLength[lane];
+            for (i = 0; i < 5; i++)
+                ref->cpu.regFile[i] = fuzzLaneRegister(lane, i);
+            while (!ref->halted && ref->cpu.PC < SIZE_OF_MEM && ref->cpu.perf.instructionsRetired < FUZZ_MAX_STEPS)
+                stepCore(ref, program->origin);
+            total += ref->cpu.perf.instructionsRetired;
+            steps = ref->cpu.perf.instructionsRetired + (!ref->halted && ref->cpu.PC >= SIZE_OF_MEM); //The batch counts the faulting fetch.
+            if (batch->steps[lane] != steps)
+                differ = fuzzReport(detail, "lane %d ran %lu instructions, reference %lu", lane, batch->steps[lane], steps);
+            differ = differ || fuzzCompareLane(reference, batch, lane, detail);
+            for (i = 0; i < FUZZ_IMAGE_SIZE && !differ; i++) {
+                if (batch->memory[i][lane] != debugRead(i))
+                    differ = fuzzReport(detail, "lane %d memory[x%04X] is x%04X, reference x%04X", lane, (Register) (i + program->origin), batch->memory[i][lane], debugRead(i));
+            }
+        }
+        *instructions = total;
+        return differ;
+    }
+    if (engine == FUZZ_SUPERBLOCK) {
+        fuzzReset(candidate, program);
+        while (!differ && !core->halted && core->cpu.perf.instructionsRetired < FUZZ_MAX_STEPS) {
+            fuzzSwitch(candidate);
+            if (runStep(core, 1, breakpoints, &numBreakpoints, program->origin) == IDLE_LOOP)
+                break;
+            fuzzSwitch(reference);
+            while (!ref->halted && ref->cpu.perf.instructionsRetired < core->cpu.perf.instructionsRetired)
+                stepCore(ref, program->origin);
+            differ = fuzzCompareCores(reference, candidate, FUZZ_IMAGE_SIZE, detail);
+        }
+        differ = differ || fuzzCompareCores(reference, candidate, SIZE_OF_MEM, detail);
+    } else {
+        fuzzResetBatch(batch, program, lanes);
+        while (!differ && batch->state[0] == LANE_RUNNING && batch->steps[0] < FUZZ_MAX_STEPS) {
+            pc = batch->PC[0];
+            words = pc >= SIZE_OF_MEM || fuzzMayStore(batch->memory[pc][0]) ? FUZZ_IMAGE_SIZE : 0;
+            if (engine == FUZZ_VECTOR && pc < SIZE_OF_MEM) {
+                batchStepVector(batch, (1u << lanes) - 1, pc, program->origin);
+            } else {
+                for (lane = 0; lane < lanes; lane++)
+                    batchStepScalar(batch, lane, program->origin);
+            }
+            for (lane = 0; lane < lanes; lane++)
+                batch->steps[lane]++;
+            if (!ref->halted)
+                stepCore(ref, program->origin);
+            for (lane = 0; lane < lanes && !differ; lane++)
+                differ = fuzzCompareLane(reference, batch, lane, detail);
+            for (i = 0; i < words; i++)
+                expected[i] = debugRead(i);
+            differ = differ || fuzzCompareLaneMemory(batch, expected, words, program->origin, detail);
+        }
+        for (i = 0; i < SIZE_OF_MEM; i++)
+            expected[i] = debugRead(i);
+        differ = differ || fuzzCompareLaneMemory(batch, expected, SIZE_OF_MEM, program->origin, detail);
+    }
+    *instructions = ref->cpu.perf.instructionsRetired;
+    return differ;
+}
+
+//Shrinks a program that makes an engine disagree with the reference: whole slots become NOPs, and
+//the input is cut short, for as long as they still disagree. Returns the instructions left.
+int fuzzShrink(Fuzz_Machine machines[], Batch_p batch, Fuzz_Program *program, int engine, char *detail, unsigned long *instructions) {
+    Register saved[FUZZ_MAX_SLOT];
+    int slot, start, length, a, shrunk = 1, left = 0;
+    while (shrunk) {
+        shrunk = 0;
+        for (slot = 1; slot < program->numSlots - 1; slot++) { //Not the prologue or the final HALT.
+            start = program->slotStart[slot];
+            length = program->slotStart[slot + 1] - start;
+            for (a = start; a < start + length && program->image[a] == 0; a++);
+            if (a == start + length)
+                continue;
+            memcpy(saved, &program->image[start], length * sizeof(Register));
+            memset(&program->image[start], 0, length * sizeof(Register));
+            if (fuzzRun(machines, batch, program, engine, detail, instructions))
+                shrunk = 1;
+            else
+                memcpy(&program->image[start], saved, length * sizeof(Register));
+        }
+    }
+    while (program->inputLength > 0) {
+        program->inputLength--;
+        if (!fuzzRun(machines, batch, program, engine, detail, instructions)) {
+            program->inputLength++;
+            break;
+        }
+    }
+    fuzzRun(machines, batch, program, engine, detail, instructions); //detail and instructions of what is left.
+    for (a = 0; a < FUZZ_CODE_SIZE; a++) {
+        if (program->image[a] != 0)
+            left++;
+    }
+    return left;
+}
+
+//Writes a reduced program as a hex file LOAD reads, and its input as a line -b reads.
+void fuzzSave(Fuzz_Program *program, int number) {
+    char name[FUZZ_DETAIL_SIZE];
+    FILE *fp;
+    int a;
+    sprintf(name, "fuzz%d.hex", number);
+    if ((fp = fopen(name, "w")) == NULL)
+        return;
+    fprintf(fp, "%04X\n", program->origin);
+    for (a = 0; a < FUZZ_IMAGE_SIZE; a++) {
+        fprintf(fp, "%04X\n", program->image[a]);
+    }
+    fclose(fp);
+    sprintf(name, "fuzz%d.txt", number);
+    if ((fp = fopen(name, "w")) == NULL)
+        return;
+    printEscaped(fp, program->input, program->inputLength);
+    fprintf(fp, "\n");
+    fclose(fp);
+}
+
+//Differential fuzzing: generates programs from seed and runs each on the reference engine and on
+//every candidate engine, comparing them step by step. A mismatch is shrunk and saved as
+//fuzz<program>.hex and fuzz<program>.txt. Returns 0 if every engine agreed, otherwise 1.
+int fuzz(int programs, unsigned long seed) {
+    static const char *engineNames[NUM_FUZZ_ENGINES] = {"superblock", "vector", "scalar", "lockstep"};
+    Fuzz_Machine *machines = malloc(2 * sizeof(Fuzz_Machine));
+    Batch_p batch = malloc(sizeof(Batch_s));
+    Fuzz_Program *program = malloc(sizeof(Fuzz_Program));
+    char detail[FUZZ_DETAIL_SIZE];
+    unsigned long long state;
+    unsigned long instructions, total = 0, started = monitorClock(), elapsed;
+    int i, engine, a, n, left, mismatches = 0;
+    numCores = 1;
+    executionMode = ROUND_ROBIN;
+    memoryLatency = 0;
+    setTraceLevel(TRACE_OFF);
+    for (i = 0; i < programs; i++) {
+        for (engine = 0; engine < NUM_FUZZ_ENGINES; engine++) {
+            state = (seed << 32 | i) * 2 + 1; //Never 0, which xorshift would keep.
+            fuzzGenerate(program, &state);
+            if (engine == FUZZ_LOCKSTEP && fuzzPick(&state, 2))
+                fuzzWildJump(program, &state);
+            for (n = engine == FUZZ_SUPERBLOCK ? fuzzPick(&state, 3) : 0; n > 0; n--)
+                fuzzPerfLoad(program, &state);
+            if (!fuzzRun(machines, batch, program, engine, detail, &instructions)) {
+                total += instructions;
+                continue;
+            }
+            mismatches++;
+            printf("Program %d: %s engine differs after %lu instructions, %s\n", i, engineNames[engine], instructions, detail);
+            left = fuzzShrink(machines, batch, program, engine, detail, &instructions);
+            printf("  reduced to %d instructions, differs after %lu: %s\n", left, instructions, detail);
+            for (a = 0; a < FUZZ_CODE_SIZE; a++) {
+                if (program->image[a] != 0)
+                    printf("  x%04X: x%04X\n", a + program->origin, program->image[a]);
+            }
+            printf("  input: ");
+            printEscaped(stdout, program->input, program->inputLength);
+            printf("\n");
+            fuzzSave(program, i);
+            printf("  saved as fuzz%d.hex and fuzz%d.txt\n", i, i);
+        }
+    }
+    elapsed = monitorClock() - started;
+    printf("Fuzz: %d programs from seed %lu, %lu instructions compared in %lu ms, %d mismatches\n",
+           programs, seed, total, elapsed, mismatches);
+    free(machines);
+    free(batch);
+    free(program);
+    return mismatches > 0;
+}
+
+int main(int argc, char * argv[]) {
+    pthread_mutexattr_t busLockAttr;
+    int option;
+    char *gdbTarget = NULL;
+    char *batchInputs = NULL;
+    int fuzzPrograms = 0;
+    unsigned long fuzzSeed = time(NULL);
+    while ((option = getopt(argc, argv, "c:prg:t:b:f:")) != -1) {
+        switch (option) {
+            case 'c': //Number of cores sharing memory.
+                numCores = atoi(optarg);
+                if (numCores < 1 || numCores > MAX_NUM_CORES) {
+                    printf("Number of cores must be between 1 and %d\n", MAX_NUM_CORES);
+                    return 1;
+                }
+                break;
+            case 'p': //Run each core on its own host thread.
+                executionMode = THREADED;
+                break;
+            case 'r': //Reference engine only.
+                referenceOnly = 1;
+                break;
+            case 'g': //Serve a debugger on a TCP port or Unix socket instead of the menu.
+                gdbTarget = optarg;
+                break;
+            case 'b': //Run the program once per line of a file of GETC input, many instances at a time.
+                batchInputs = optarg;
+                break;
+            case 'f': //Compare the fast engines with the reference on generated programs, then exit.
+                if (sscanf(optarg, "%d,%lu", &fuzzPrograms, &fuzzSeed) < 1 || fuzzPrograms < 1) {
+                    printf("Usage: %s -f programs[,seed]\n", argv[0]);
+                    return 1;
+                }
+                break;
+            case 't': //Initial trace level, the menu sets the filters.
+                if (atoi(optarg) < TRACE_OFF || atoi(optarg) >= NUM_TRACE_LEVELS) {
+                    printf("Trace level must be between %d and %d\n", TRACE_OFF, NUM_TRACE_LEVELS - 1);
+                    return 1;
+                }
+                setTraceLevel(atoi(optarg));
+                break;
+            default:
+                printf("Usage: %s [-c cores] [-p] [-r] [-t level] [-g port|socket program] [-b inputs program] [-f programs[,seed]]\n", argv[0]);
+                return 1;
+        }
+    }
+    pthread_mutexattr_init(&busLockAttr);
+    pthread_mutexattr_settype(&busLockAttr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&busLock, &busLockAttr);
+    initializeCores(DEFAULT_ADDRESS);
+    int shownCore = 0;
+    CPU_p cpu_pointer = &cores[0].cpu;
+    ALU_p alu_pointer = &cores[0].alu;
+    char input[INPUT_SIZE];
+    char file_name[INPUT_SIZE];
+    char program_name[INPUT_SIZE] = "";
+    time_t programModified = 0;
+    off_t programSize = 0;
+    int reloading = 0;
+    int choice;
+    char *temp;
+    int temp_offset;
+    int offset = 0;
+    int save_temp = 0;
+    unsigned short start_address = DEFAULT_ADDRESS;
+    int loadedProgram = 0;
+    int programHalted = 0;
+    int n;
+    int owCheck;
+    int saveCheck = 1;
+    unsigned int start, end;
+    Register breakpoints[MAX_NUM_BKPTS];
+    int numBreakpoints = 0;
+    clearBreakpoints(breakpoints);
+    initializeCaches();
+    monitor.interactive = isatty(1) && getenv("TERM") != NULL && strcmp(getenv("TERM"), "dumb") != 0;
+    
+    if (gdbTarget != NULL) {
+      if (optind >= argc) {
+        printf("Usage: %s [-c cores] [-r] -g port|socket program\n", argv[0]);
+        return 1;
+      }
+      if (loadProgram(argv[optind], &start_address) < 0)
+        return 1;
+      initializeCores(start_address);
+      return gdbServe(gdbTarget, start_address);
+    }
+    if (batchInputs != NULL) {
+      if (optind >= argc) {
+        printf("Usage: %s -b inputs program\n", argv[0]);
+        return 1;
+      }
+      if (loadProgram(argv[optind], &start_address) < 0)
+        return 1;
+      return runBatchFile(batchInputs, start_address);
+    }
+    if (fuzzPrograms > 0)
+      return fuzz(fuzzPrograms, fuzzSeed);
+
+  while (1) {
+	  printCurrentState("           Welcome to the LC-3 Simulator Simulator", cpu_pointer, alu_pointer, offset, start_address);
+    if (numCores > 1)
+      printCoreSummary(shownCore, start_address);
+	  printf("Select: 1) Load, 2) Save, 3) Step, 4) Run, 5) Display Mem, 6) Edit, 7) Set Bkpt, 8) Unset Bkpt, 9) Exit, 10) Trace\n> ");
+    fflush(stdout);
+    if (!waitForMenuInput(program_name, &programModified, &programSize)) { //Source changed on disk, load it again.
+      printf("\nReloaded %s\n", program_name);
+      reloading = 1;
+      choice = LOAD;
+    } else {
+      scanf("%d", &choice);
+    }
+    switch(choice){
+      case LOAD:
+        if (!reloading) {
+          printf("File name: ");
+          scanf("%s", program_name);
+        }
+        if (loadProgram(program_name, &start_address) < 0) {
+          printf("Press <ENTER> to continue");
+          loadedProgram = 0;
+          if (!reloading) //Keep watching a source that failed to reassemble, the next save may fix it.
+            program_name[0] = '\0';
+          reloading = 0;
+          getEnterInput();
+        } else {
+          reloading = 0;
+          fileChanged(program_name, &programModified, &programSize); //Start watching from this version.
+          loadedProgram = 1;
+          programHalted = 0;
+          numBreakpoints = 0;
+          clearBreakpoints(breakpoints);
+          initializeCaches();
+          //Initialize cpu fields;
+          initializeCores(start_address);
+          shownCore = 0;
+          cpu_pointer = &cores[0].cpu;
+          alu_pointer = &cores[0].alu;
+        }
+        break;
+      case STEP:
+        if (loadedProgram == 1) {
+          int c;
+          for (c = 0; c < numCores; c++) { //One round-robin turn, every live core executes one instruction.
+            if (!cores[c].halted)
+              stepCore(&cores[c], start_address);
+          }
+          if (liveCores() == 0) {
+            loadedProgram = 0;
+            programHalted = 1;                        
+            printf("\n======Program halted.======\n");
+            printPerfCounters();
+            if (numCores > 1)
+              printCoherenceStats();
+            printf("Press <ENTER> to continue.");
+            numBreakpoints = 0;
+            clearBreakpoints(breakpoints);
+            getEnterInput();
+          }
+        } else if (programHalted == 1){
+          printf("Your program has halted. Please load another program. \nPress <ENTER> to continue.");
+          getEnterInput();
+        } else {
+          printf("Please load a program first. Press <ENTER> to continue");
+          getEnterInput();
+        }
+        break;
+      case RUN:
+        if (loadedProgram == 1) {
+          int stoppedCore = 0;
+          int reachedBreakpoint;
+          monitor.running = 1;
+          if (executionMode == THREADED && numCores > 1)
+            reachedBreakpoint = runThreaded(breakpoints, &numBreakpoints, start_address, &stoppedCore);
+          else
+            reachedBreakpoint = runRoundRobin(breakpoints, &numBreakpoints, start_address, &stoppedCore);
+          monitor.running = 0;
+          
+          if (reachedBreakpoint == IDLE_LOOP) {
+              shownCore = stoppedCore;
+              cpu_pointer = &cores[shownCore].cpu;
+              alu_pointer = &cores[shownCore].alu;
+              printf("Idle loop detected at x%04X", cpu_pointer->PC + start_address);
+              if (numCores > 1)
+                printf(" (core %d)", shownCore);
+              printf(": nothing can change the value it is waiting on.\nPress <ENTER> to return to the menu.");
+              getEnterInput();
+          } else if (reachedBreakpoint) {
+              shownCore = stoppedCore;
+              cpu_pointer = &cores[shownCore].cpu;
+              alu_pointer = &cores[shownCore].alu;
+              printf("Reached breakpoint: x%04X", cpu_pointer->PC + start_address);
+              if (symbolAt(cpu_pointer->PC + start_address) != NULL)
+                printf(" (%s)", symbolAt(cpu_pointer->PC + start_address));
+              if (numCores > 1)
+                printf(" (core %d)", shownCore);
+              printf("\nPress <ENTER> to return to the menu.");
+              getEnterInput();
+          } else {
+            int c, reachedEnd = 0;
+            loadedProgram = 0;
+            programHalted = 1;
+            for (c = 0; c < numCores; c++) {
+              if (cores[c].halted == END_OF_MEMORY)
+                reachedEnd = 1;
+            }
+            
+            printPerfCounters();
+            if (numCores > 1)
+              printCoherenceStats();
+            if (reachedEnd)
+              printf("\n======= END OF MEMORY REACHED =======\nPlease include a HALT in your program to prevent this from happening.\nPress <ENTER> to continue.");
+            else
+              printf("\n======Program halted.======\nPress <ENTER> to continue.");
+            numBreakpoints = 0;
+            clearBreakpoints(breakpoints);
+            getEnterInput();
+          }
+        } else if (programHalted == 1){
+          printf("Your program has halted. Please load another program.\nPress <ENTER> to continue.");
+          getEnterInput();
+        } else {
+          printf("Please load a program first. Press <ENTER> to continue.");
+          getEnterInput();
+        }
+        break;
+      case DISPLAY_MEM:
+        printf("Starting Address: ");
+        scanf("%s", input);
+        temp_offset = resolveAddress(input);
+        if(temp_offset < 0 || temp_offset >= NEG_NUM_MASK){
+          printf("Not a valid address <ENTER> to continue.");
+          getEnterInput();
+        } else {
+          offset = temp_offset - start_address;
+        }
+        break;
+	  case EDIT:
+		  printf("The memory address to be edited: ");
+		  scanf("%s", input);
+		  temp_offset = resolveAddress(input) - start_address;
+		  if (temp_offset >= SIZE_OF_MEM || temp_offset < 0) {
 			  printf("Not a valid address <ENTER> to continue.");
 			  getEnterInput();
 		  }
@@ -652,6 +4257,8 @@ int main(int argc, char * argv[]) {
 			  printf("The new contents to be entered in hex: ");
 			  scanf("%s", input);
 			  memory[temp_offset] = strtol(input, &temp, STRTOL_BASE);
+			  if (isCodeAddress(temp_offset))
+				  invalidateCode(temp_offset);
 		  }
 		  break;
       case SAVE:
@@ -707,7 +4314,7 @@ int main(int argc, char * argv[]) {
         }
         printf("The memory address to break at: ");
 		    scanf("%s", input);
-		    temp_offset = strtol(input, &temp, STRTOL_BASE) - start_address;
+		    temp_offset = resolveAddress(input) - start_address;
 		    if (temp_offset >= SIZE_OF_MEM || temp_offset < 0) {
 			    printf("Not a valid address, press <ENTER> to continue.");
 			    getEnterInput();
@@ -733,7 +4340,7 @@ int main(int argc, char * argv[]) {
         
         printf("The memory address to unset: ");
 		    scanf("%s", input);
-		    temp_offset = strtol(input, &temp, STRTOL_BASE) - start_address;
+		    temp_offset = resolveAddress(input) - start_address;
 		    if (temp_offset >= SIZE_OF_MEM || temp_offset < 0) {
 			    printf("Not a valid address, press <ENTER> to continue.");
 			    getEnterInput();
@@ -756,6 +4363,27 @@ int main(int argc, char * argv[]) {
           }
         }
           break;
+      case TRACE:
+        printf("Trace level (0 off, 1 instructions, 2 microstates, 3 memory accesses): ");
+        scanf("%d", &temp_offset);
+        if (temp_offset < TRACE_OFF || temp_offset >= NUM_TRACE_LEVELS) {
+          printf("Not a valid trace level, press <ENTER> to continue.");
+          getEnterInput();
+          break;
+        }
+        if (temp_offset != TRACE_OFF) {
+          printf("Trace from address (0 for all): ");
+          scanf("%s", input);
+          trace.low = resolveAddress(input);
+          printf("Trace to address (FFFF for all): ");
+          scanf("%s", input);
+          trace.high = resolveAddress(input);
+          printf("Opcodes to trace as a hex mask, bit n for opcode n (FFFF for all): ");
+          scanf("%s", input);
+          trace.opcodes = strtol(input, &temp, STRTOL_BASE);
+        }
+        setTraceLevel(temp_offset);
+        break;
       case EXIT:
         printf("Goodbye\n");
         return 0;
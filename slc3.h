@@ -6,7 +6,6 @@
 #ifndef LC3_H
 #define LC3_H
 
-#define DEBUG 0
 #define INPUT_SIZE 50
 #define SIZE_OF_MEM 4096
 #define SIZE_OF_CACHE 1024
@@ -56,6 +55,82 @@
 #define DATA_CACHE_OFFSET 0x0A00
 #define NEG_BIT_MASK 4
 #define ZERO_BIT_MASK 2
+#define MAX_NUM_CORES 8
+#define CODE_PAGE_SIZE 64
+#define MEMORY_ACCESS_CYCLES 10 //Cycles charged to the counters for each trip to memory.
+#define CYCLES_PER_INSTRUCTION 6 //FETCH through STORE when every access hits in the caches.
+#define MAX_LOOP_ITERATIONS 0x10000 //A 16-bit loop counter repeats after this many iterations.
+#define LOOP_BACK_OFFSET 0x01FE //pcOffset9 of -2, a BR back to the instruction before it.
+#define SUPERBLOCK_THRESHOLD 8 //Times a block head is entered before a superblock is formed from it.
+#define NUM_SUPERBLOCKS 64
+#define MAX_SUPERBLOCK_OPS 32
+#define MAX_FUSED_INSTRUCTIONS 4
+#define MAX_TRACE_CALL_DEPTH 4
+#define NZP_MASK 7
+#define OP_SINGLE 0            //One LC-3 instruction, executed on its own.
+#define OP_LOAD_ADD_BRANCH 1   //LD Rx, label; ADD Rd, Rs1, Rs2; BR
+#define OP_ALU_BRANCH 2        //ADD/AND; BR
+#define OP_NEGATE 3            //NOT Rd, Rs; ADD Rd, Rd, #1
+#define OP_PUSH 4              //ADD R6, R6, #-1; STR Rx, R6, #0
+#define OP_POP 5               //LDR Rx, R6, #0; ADD R6, R6, #1
+#define OP_PUP_RUN 6           //Consecutive PUPs in the same direction
+#define SYMBOL_TABLE_SIZE 2048 //Power of two, open addressing.
+#define MAX_LABEL_LENGTH 64
+#define MAX_TOKENS 8
+#define WATCH_INTERVAL_MS 500 //How often the loaded source is checked for changes while the menu waits.
+#define GDB_PACKET_SIZE 4096
+#define GDB_NUM_REGISTERS 10 //R0-R7, PC, CC
+#define GDB_PC_REGISTER 8
+#define GDB_CC_REGISTER 9
+#define GDB_POLL_INTERVAL_MS 50 //How often a running target checks the connection for an interrupt.
+#define GDB_SIGTRAP 5
+#define GDB_SIGINT 2
+#define MAX_NUM_WATCHPOINTS 4
+#define ALL_OPCODES 0xFFFF //Trace filter with the bit of every opcode set.
+#define BATCH_LANES 16 //Instances run in lockstep, one 16-bit lane of a vector each.
+#define BATCH_OUTPUT_SIZE 1024
+#define BATCH_MAX_STEPS 10000000 //Instructions an instance may run before it is stopped.
+#define FUZZ_CODE_SIZE 160   //Words of generated code, prologue and final HALT included.
+#define FUZZ_POOL 160        //LDI/STI pointers, the stack top and PUTS strings. Never written.
+#define FUZZ_NUM_POINTERS 8
+#define FUZZ_STACK_POINTER (FUZZ_POOL + FUZZ_NUM_POINTERS)
+#define FUZZ_NUM_STRINGS 3
+#define FUZZ_STRING_SIZE 7   //Longest PUTS string plus its terminator, the strings fit before FUZZ_DATA.
+#define FUZZ_DATA 192        //The only words loads and stores through R5 reach, R5 points at the middle.
+#define FUZZ_DATA_SIZE 64
+#define FUZZ_STACK_TOP 288   //Initial R6, pushes grow down from it.
+#define FUZZ_IMAGE_SIZE 288  //Memory a generated program can touch.
+#define FUZZ_MAX_SLOT 5      //Longest run of instructions generated as one unit.
+#define FUZZ_MAX_STEPS 20000 //Instructions run before a program that has not halted is cut off.
+#define FUZZ_INPUT_SIZE 16
+#define FUZZ_DETAIL_SIZE 96
+#define MONITOR_ROW_SIZE 256
+#define MONITOR_TOP_ROW 1 //Terminal row of the monitor title, the frame follows it.
+#define MONITOR_MENU_ROWS 8 //Room the core summary, menu and messages take under the frame.
+#define MONITOR_FRAME_INTERVAL_MS 100 //Least time between frames drawn while RUN is tracing.
+#define HIGHLIGHT_ON "\033[7m" //Reverse video for values that changed since the last frame.
+#define HIGHLIGHT_OFF "\033[0m"
+#define WATCH_WRITE 2  //Z2
+#define WATCH_READ 3   //Z3
+#define WATCH_ACCESS 4 //Z4
+
+//Memory-mapped performance counters (absolute addresses, uncached). Reading a LO half latches
+//its HI half, so reading LO and then HI gives one 32-bit value even across a carry.
+#define PERF_CYCLE_LO 0xFE10
+#define PERF_CYCLE_HI 0xFE11
+#define PERF_INSTRET_LO 0xFE12
+#define PERF_INSTRET_HI 0xFE13
+#define PERF_ICACHE_MISSES 0xFE14
+#define PERF_DCACHE_MISSES 0xFE15
+#define PERF_CONTROL 0xFE16
+#define PERF_RESET_BIT 0x0001  //Write 1 to zero every counter.
+#define PERF_FREEZE_BIT 0x0002 //Counters hold their values while set.
+#define NUM_CODE_PAGES (SIZE_OF_MEM / CODE_PAGE_SIZE)
+#define SHARED_BIT_MASK 0x0010
+#define MESI_STATE_MASK 0x001C
+#define MODIFIED_STATE 0x000C  //valid + dirty
+#define EXCLUSIVE_STATE 0x0008 //valid
+#define SHARED_STATE 0x0018    //valid + shared
 
 #define FETCH 0
 #define DECODE 1
@@ -96,14 +171,52 @@
 #define EDIT 6
 #define BRKPT 7
 #define EXIT 9
+#define TRACE 10
 
 #define GETC 32 //0x20
 #define OUT 33 //0x21
 #define PUTS 34 //0x22
+#define IN 35 //0x23
+#define PUTSP 36 //0x24
 #define HALT 37 //0x25
+#define SWAP 38 //0x26, atomically exchanges R0 with M[R1]
+#define CPUID 39 //0x27, R0 = id of the executing core
+
+#define ROUND_ROBIN 0
+#define THREADED 1
+#define END_OF_MEMORY 2
+#define BREAKPOINT_REACHED 3
+#define IDLE_LOOP 4
+#define FAST_FORWARDED 5
+#define SIDE_EXIT 6
+#define INTERRUPTED 7
+#define WATCHPOINT_REACHED 8
+
+#define LANE_RUNNING 0 //Batch instance states, besides HALT and END_OF_MEMORY.
+#define LANE_SPLIT 1   //Diverged from its lockstep group, waits for the next round.
+#define LANE_TIMEOUT 9
+#define LANE_FAULT 10  //Touched an address outside memory.
+
+#define FUZZ_SUPERBLOCK 0 //Engines the fuzzer compares with the reference: RUN's fast path,
+#define FUZZ_VECTOR 1     //the batch engine's vector kernel with every lane running the program,
+#define FUZZ_SCALAR 2     //its scalar stepper,
+#define FUZZ_LOCKSTEP 3   //and runBatch splitting and regrouping lanes started differently.
+#define NUM_FUZZ_ENGINES 4
+
+#define TRACE_OFF 0
+#define TRACE_INSTRUCTION 1 //One line per instruction with the registers after it.
+#define TRACE_MICROSTATE 2  //The monitor after every microstate.
+#define TRACE_MEMORY 3      //One line per data read or write, those of traps included.
+#define NUM_TRACE_LEVELS 4
 
 typedef unsigned short Register;
 
+typedef struct Cache_Entry {
+    Register entryInfo;
+    Register data;
+}
+Cache_Entry; 
+
 typedef struct ALU_s {
     Register A;
     Register B;
@@ -113,6 +226,51 @@ ALU_s;
 
 typedef ALU_s * ALU_p;
 
+typedef struct Perf_Counters {
+    unsigned long cycles;
+    unsigned long instructionsRetired;
+    unsigned long instructionCacheMisses;
+    unsigned long dataCacheMisses;
+    Register control;
+    Register cyclesHigh, instructionsRetiredHigh; //HI halves latched by the last read of the LO half.
+}
+Perf_Counters;
+
+typedef struct Symbol {
+    char name[MAX_LABEL_LENGTH];
+    Register address; //Absolute address of the label.
+    int used;
+}
+Symbol;
+
+//One source line of an .asm file after tokenizing, kept between the two assembler passes.
+typedef struct Asm_Line {
+    int number;
+    int numTokens;
+    char *tokens[MAX_TOKENS];
+    char *string;     //Operand of .STRINGZ, escapes already processed.
+    int stringLength;
+    Register address; //Assigned in the first pass.
+}
+Asm_Line;
+
+//Runtime trace level and filters. The address range is absolute, and is matched against the
+//instruction's address, or the accessed word's for TRACE_MEMORY.
+typedef struct Trace_Settings {
+    int level;
+    Register low, high;
+    Register opcodes; //Bit n set traces opcode n.
+}
+Trace_Settings;
+
+//A data watchpoint set by the debugger, length in words.
+typedef struct Watchpoint {
+    Register address; //Offset into memory[], like breakpoints.
+    Register length;
+    int type; //WATCH_WRITE, WATCH_READ or WATCH_ACCESS
+}
+Watchpoint;
+
 typedef struct CPU_s {
 	Register regFile[8];
     int n, z, p;
@@ -121,15 +279,146 @@ typedef struct CPU_s {
     Register MAR;
     Register MDR;
     Register CC;
+    Cache_Entry *instructionCache; //Private L1 caches of the core this CPU belongs to.
+    Cache_Entry *dataCache;
+    int coreId;
+    Register origin; //start_address of the loaded program, used to decode memory-mapped registers.
+    Perf_Counters perf;
+    unsigned long memoryStall; //Microseconds of memory latency run up on the bus, slept once it is released.
 }
 CPU_s;
 
+//Advances a performance counter unless the guest has frozen them.
+#define PERF_COUNT(cpu, counter, amount) \
+    do { if (!((cpu)->perf.control & PERF_FREEZE_BIT)) (cpu)->perf.counter += (amount); } while (0)
+
 typedef struct CPU_s * CPU_p;
 
-typedef struct Cache_Entry {
-    Register entryInfo;
-    Register data;
+//Fields of one instruction, pulled out of the IR once when a superblock is formed.
+typedef struct Decoded_Instruction {
+    Register word;
+    Register address;
+    Register opcode, Rd, Rs1, Rs2; //Rd doubles as nzp for BR.
+    Register offset; //Sign-extended immed5 or pcOffset.
+    int immediate;   //ADD/AND use immed5.
 }
-Cache_Entry; 
+Decoded_Instruction;
+
+//One internal operation of a superblock, covering one or more fused instructions.
+typedef struct Micro_Op {
+    int kind;   //OP_SINGLE or one of the fused idioms
+    int length; //Number of LC-3 instructions covered
+    Decoded_Instruction parts[MAX_FUSED_INSTRUCTIONS];
+}
+Micro_Op;
+
+//A hot path starting at head, following unconditional branches and calls.
+typedef struct Superblock {
+    int valid;
+    Register head;
+    Register lowAddress, highAddress; //Range of the instructions covered, for invalidation.
+    int numOps;
+    Micro_Op ops[MAX_SUPERBLOCK_OPS];
+}
+Superblock;
+
+//One processor of the system: register file, ALU and private L1 caches.
+typedef struct Core_s {
+    CPU_s cpu;
+    ALU_s alu;
+    Cache_Entry instructionCache[SIZE_OF_CACHE];
+    Cache_Entry dataCache[SIZE_OF_CACHE];
+    int halted; //0 while running, otherwise HALT or END_OF_MEMORY
+    unsigned short executionCount[SIZE_OF_MEM]; //Times each block head has been entered.
+    Register fallThroughPC; //PC a sequential step would reach, anything else is a block head.
+    Superblock superblocks[NUM_SUPERBLOCKS]; //Direct mapped on the head address.
+}
+Core_s;
+
+typedef struct Core_s * Core_p;
+
+//Structure-of-arrays state of BATCH_LANES instances of one program. Every register, and every
+//word of memory, is a row with one column per instance, so a vector operation updates it for
+//the whole batch.
+typedef struct Batch_s {
+    Register regFile[8][BATCH_LANES];
+    Register PC[BATCH_LANES];
+    Register CC[BATCH_LANES];
+    Register memory[SIZE_OF_MEM][BATCH_LANES];
+    int state[BATCH_LANES];
+    unsigned long steps[BATCH_LANES]; //Instructions executed.
+    const char *input[BATCH_LANES];   //GETC stream of each instance.
+    int inputLength[BATCH_LANES], inputPosition[BATCH_LANES];
+    char output[BATCH_LANES][BATCH_OUTPUT_SIZE]; //What OUT and PUTS printed.
+    int outputLength[BATCH_LANES];
+    int numLanes;
+}
+Batch_s;
+
+typedef struct Batch_s * Batch_p;
+
+//Console of a guest that is not attached to the terminal: GETC reads input (0 once it runs out)
+//and OUT and PUTS append to output.
+typedef struct Console_Script {
+    const char *input;
+    int inputLength, inputPosition;
+    char output[BATCH_OUTPUT_SIZE];
+    int outputLength;
+}
+Console_Script;
+
+//Everything one simulated system owns. The fuzzer keeps one for the reference engine and one for
+//the candidate, and points the globals at whichever is running.
+typedef struct Fuzz_Machine {
+    Register memory[SIZE_OF_MEM];
+    Core_s cores[MAX_NUM_CORES];
+    unsigned char codePages[NUM_CODE_PAGES];
+    Console_Script console;
+}
+Fuzz_Machine;
+
+//A generated program with its GETC input. The code is a sequence of slots, instructions that are
+//only valid together (a push and its pop, a PUTS and the LEA of its string); branches only
+//target the start of a slot, and shrinking replaces whole slots with NOPs.
+typedef struct Fuzz_Program {
+    Register origin;
+    Register image[FUZZ_IMAGE_SIZE];
+    int slotStart[FUZZ_CODE_SIZE + 1]; //Ends with the end of the code.
+    int numSlots;
+    char input[FUZZ_INPUT_SIZE];
+    int inputLength;
+}
+Fuzz_Program;
+
+//What the debug monitor last drew, so the next frame only redraws the rows that changed and
+//highlights the values that differ from this snapshot.
+typedef struct Monitor_s {
+    int interactive; //stdout is a terminal, so cursor addressing and highlighting are used.
+    int onScreen;    //rows are what the terminal shows. Cleared when other output may have scrolled it.
+    int running;     //RUN in progress, trace frames are rate limited.
+    unsigned long lastFrame; //Milliseconds, when the last trace frame was drawn.
+    char rows[DISPLAY_SIZE + 2][MONITOR_ROW_SIZE]; //Title, column headings, DISPLAY_SIZE rows.
+    int hasSnapshot;
+    CPU_s cpu;
+    ALU_s alu;
+    Register instructionCache[DISPLAY_SIZE * NUM_WORDS_IN_BLOCK];
+    Register dataCache[DISPLAY_SIZE * NUM_WORDS_IN_BLOCK];
+    Register memory[DISPLAY_SIZE];
+    int memOffset;
+}
+Monitor_s;
+
+//Snooping bus traffic counters.
+typedef struct Coherence_Stats {
+    unsigned long busReads;      //BusRd issued on a read miss
+    unsigned long busReadXs;     //BusRdX issued on a write miss
+    unsigned long busUpgrades;   //BusUpgr issued on a write hit to a Shared line
+    unsigned long invalidations; //Remote copies invalidated
+    unsigned long interventions; //Remote Modified copies flushed to memory
+    unsigned long writeBacks;    //Dirty lines written back to memory
+    unsigned long atomics;       //SWAP traps executed
+}
+Coherence_Stats;
+
 
 #endif